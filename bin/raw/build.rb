@@ -14,17 +14,21 @@ if action == "help"
   puts '--build: builds a specified library, ourputs binary'
   puts '--clean: cleans .o files from specified library, no arguments removes .hex and .elf files'
   puts '--rebuild: cleans then builds a specified library'
-  puts '--compile: builds .cpp file in main directory, outputs .elf and .hex file'
+  puts '--compile: builds .cpp file in main directory, outputs .elf and .hex file, then reports the memory use'
   print "\n"
   puts '-argument'
   puts '--library: builds, rebuilds, or cleans specific library in src folder'
   puts '--all: builds, rebuilds, or cleans all libraries in src folder'
+  puts '--profile: a section of bin/settings.ini, e.g. compile lean, its settings replace [Settings]'
   exit
 end
 
 # read an existing file
 file = IniFile.load('bin/settings.ini',:comment => ';')
 data = file["Settings"]
+# a second argument naming a section of settings.ini (compile lean) is a build profile
+PROFILE = library && file.has_section?(library.capitalize) ? library.capitalize : nil
+data = data.merge(file[PROFILE]) if PROFILE
 CODENAME=data["CODENAME"] #here to get the .cpp code
 PROGRAMMER=data["PROGRAMMER"] #programmer type
 LIBS= data["LIBS"]
@@ -36,6 +40,7 @@ COMPORT=data["COMPORT"]
 VARIANT=data["VARIANT"] #where to get the `pins_arduino.h` file
 CPUFREQ=data["CPUFREQ"]
 MCU=data["MCU"]
+RAMSIZE=data["RAMSIZE"].to_i
 PARTNO=data["PARTNO"]
 CFLAGS=data["CFLAGS"]
 CPPFLAGS=data["CPPFLAGS"]
@@ -50,6 +55,8 @@ OUT = "../../#{OUTPUTS}"
 CCFLAGS = "-I#{OUT}/include -I./#{SOURCES}/ -I./ -I./utility/ -I./variants/#{VARIANT} -I./#{OUTPUTS}/include -mmcu=#{MCU} -DF_CPU=#{CPUFREQ}"
 
 print "\n"
+print "PROFILE: "
+puts PROFILE || "Settings"
 print "PROGRAMMER: "
 puts PROGRAMMER
 print "COMPORT: "
@@ -130,6 +137,37 @@ def domake(src, action, objs,hdrs, cppflags, cflags, arflags, out, lib)
   #make sure to redirect STDOUT to STDERR so it's visible
 end
 
+# .data, .bss and what is left of the RAM for the stack, plus the largest stack frames
+# from -fstack-usage; the board reports how deep the stack really went with U
+def memory_report(elf, su_files)
+  sizes = {}
+  `avr-size -A #{elf}`.each_line do |line|
+    f = line.split
+    sizes[f[0]] = f[1].to_i if f.length >= 2 && f[0].start_with?(".")
+  end
+  return puts("no size information for #{elf}") if sizes.empty?
+  data = sizes[".data"] || 0
+  bss = (sizes[".bss"] || 0) + (sizes[".noinit"] || 0)
+  flash = (sizes[".text"] || 0) + data
+  print "\n"
+  puts "flash: #{flash} bytes (.text #{sizes[".text"] || 0}, .data initializers #{data})"
+  puts ".data: #{data} bytes"
+  puts ".bss:  #{bss} bytes"
+  puts "left for the stack: #{RAMSIZE - data - bss} of #{RAMSIZE} bytes" if RAMSIZE > 0
+  frames = su_files.flat_map { |f| File.readlines(f).map { |l| l.split("\t") } }
+  unless frames.empty?
+    puts "largest stack frames in bytes (one call, without what it calls):"
+    frames.sort_by { |f| -f[1].to_i }.first(5).each do |f|
+      puts format("  %6d  %s", f[1].to_i, f[0].split(":").last)
+    end
+  end
+  File.open("#{File.dirname(elf)}/memory.log", "a") do |log|
+    log.puts "#{Time.now.strftime("%Y-%m-%d %H:%M")}\t#{PROFILE || "Settings"}\tflash #{flash}\tdata #{data}\tbss #{bss}\tstack #{RAMSIZE - data - bss}"
+  end
+rescue Errno::ENOENT
+  puts "avr-size not found, no memory report"
+end
+
 if action == "build" || action == "rebuild"
 if ARGV.length < 2
   puts 'usage: ./build.rb action library'
@@ -163,4 +201,10 @@ else
  print "\n"
  print "Compilation Done"
  print "\n"
+ elf = "#{OUTPUTS}/codes/#{CODENAME}.elf"
+ if (action == "compile" || action == "upload") && File.exist?(elf)
+   # depending on the compiler version the .su file is written next to the source or the output
+   Dir["#{CODENAME}.su", "#{OUTPUTS}/codes/#{CODENAME}.elf-*.su"].each { |f| FileUtils.mv(f, "#{OUTPUTS}/codes/#{CODENAME}.su") }
+   memory_report(elf, Dir["#{OUTPUTS}/codes/#{CODENAME}.su", "#{SOURCES}/{#{Llibraries.join(",")}}/*.su"])
+ end
 end
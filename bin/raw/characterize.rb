@@ -0,0 +1,200 @@
+#!/bin/ruby
+# Sweeps the AD7147 decimation and sequence length (PWR_CONTROL, see the
+# comment above writePwr_Control in test.cpp) and reports noise against
+# sample rate, then picks the fastest setting that meets a noise spec.
+#
+# usage: characterize.rb simulate [options]
+#        characterize.rb live PORT [baud] [options]     sweeps a real board
+#        characterize.rb file capture.txt [options]     a capture saved with --save
+# options: --rms CODES      noise spec, worst stage RMS (default 4)
+#          --samples N      samples per setting (default 500)
+#          --save FILE      live only, keep the raw capture
+require_relative 'stream'
+
+module Characterize
+  DECIMATION = { 0 => 256, 1 => 128, 2 => 64 }
+  SWEEP = [0, 1, 2].product([3, 6, 12])   # [decimation, stages], stages 0-2 are always read
+  SETTLE = 50                             # samples thrown away after a change
+  LINE_BITS = 29 * 10                     # longest sample line (SAMPLE_LINE_MAX in test.cpp), 8N1
+  REPLY_S = 2                             # wait for the answer to C and F
+
+  Setting = Struct.new(:decimation, :stages, :power_mode, :lp_delay) do
+    def self.from_value(value)
+      new((value >> 8) & 3, ((value >> 4) & 15) + 1, value & 3, (value >> 2) & 3)
+    end
+
+    def command
+      "C#{decimation},#{stages},#{power_mode},#{lp_delay}\n"
+    end
+
+    # same as sequenceUs() in test.cpp
+    def sequence_us
+      us = stages * (768 >> decimation)
+      us += (lp_delay + 1) * 200000 if power_mode == 2
+      us
+    end
+
+    def to_s
+      "dec #{DECIMATION[decimation]}, #{stages} stages"
+    end
+  end
+
+  # overlapping Allan deviation for averaging over m samples
+  def self.allan(x, m)
+    return nil if x.length < 2 * m + 1
+    d = (0...(x.length - 2 * m)).map { |i| x[i + 2 * m] - 2 * x[i + m] + x[i] }
+    Math.sqrt(d.sum { |v| v * v } / (2.0 * m * m * d.length))
+  end
+
+  # RMS, peak-to-peak and Allan deviation at 1 and 10 samples, in codes
+  def self.noise(values)
+    mean = values.sum.to_f / values.length
+    rms = Math.sqrt(values.sum { |v| (v - mean)**2 } / values.length)
+    # the overlapping estimator works on the running sum of the samples
+    phase = values.each_with_object([0.0]) { |v, a| a << a[-1] + v - mean }
+    { rms: rms, pp: values.max - values.min, adev1: allan(phase, 1), adev10: allan(phase, 10) }
+  end
+
+  # one row of the report from the samples of one setting
+  def self.measure(setting, samples)
+    times = samples.map(&:t_ms).compact
+    rate = times.length > 1 ? 1000.0 * (times.length - 1) / (times.last - times.first) : nil
+    per_stage = (0..2).map { |i| noise(samples.map { |s| s.cdc[i] }) }
+    worst = ->(k) { per_stage.map { |n| n[k] || 0 }.max }
+    { setting: setting, conversion_rate: 1e6 / setting.sequence_us, sample_rate: rate,
+      rms: worst.call(:rms), pp: worst.call(:pp), adev1: worst.call(:adev1), adev10: worst.call(:adev10) }
+  end
+
+  # white noise that halves in power with every doubling of the decimation,
+  # plus a slow wander; the loop runs as fast as the sequence allows
+  def self.simulate(n)
+    rng = Random.new(3)
+    SWEEP.map do |dec, stages|
+      setting = Setting.new(dec, stages, 0, 0)
+      sigma = 1.5 * Math.sqrt(256.0 / DECIMATION[dec])
+      period = setting.sequence_us / 1000.0
+      wander = 0.0
+      samples = (0...n).map do |i|
+        wander += rng.rand(-0.05..0.05)
+        cdc = (0..2).map { 30000 + wander + sigma * gauss(rng) }.map(&:round)
+        Stream::Sample.new(cdc, i * period, nil)
+      end
+      measure(setting, samples)
+    end
+  end
+
+  def self.gauss(rng)
+    Math.sqrt(-2 * Math.log(1 - rng.rand)) * Math.cos(2 * Math::PI * rng.rand)
+  end
+
+  # capture with C<tab>value<tab>us lines in front of every setting
+  def self.from_file(path)
+    rows = []
+    setting = nil
+    samples = []
+    finish = -> { rows << measure(setting, samples.drop(SETTLE)) if setting && samples.length > SETTLE }
+    unwrap = Stream::Unwrap.new
+    File.foreach(path) do |line|
+      f = line.strip.split("\t")
+      if f[0] == "C"
+        finish.call
+        setting = Setting.from_value(f[1].to_i)
+        samples = []
+        next
+      end
+      kind, s = Stream.parse(line)
+      next unless kind == :sample
+      s.t_ms = unwrap.call(s.board_us) / 1000.0 if s.board_us
+      samples << s
+    end
+    finish.call
+    rows
+  end
+
+  # reads up to the reply starting with tag, the lines before it go to out too
+  def self.reply(sp, out, tag)
+    require "timeout"
+    Timeout.timeout(REPLY_S) do
+      while (line = sp.gets)
+        out.write(line)
+        f = line.strip.split("\t")
+        return f if f[0] == tag
+      end
+    end
+    nil
+  rescue Timeout::Error
+    nil
+  end
+
+  # The board cannot send samples faster than the link carries the lines (and
+  # clamps F to that), so the period is the line time at the baud rate, or the
+  # conversion sequence if that is longer. Every setting is checked against the
+  # board's answer, a setting the board did not take would be reported under
+  # the wrong name
+  def self.live(port, baud, n, save)
+    require_relative 'samplebus'
+    require "tmpdir"
+    save ||= File.join(Dir.tmpdir, "characterize_capture.txt")
+    sp = SampleBus.port(port, baud)
+    out = File.open(save, "w")
+    line_ms = LINE_BITS * 1000.0 / baud
+    SWEEP.each do |dec, stages|
+      setting = Setting.new(dec, stages, 0, 0)
+      sp.write(setting.command)
+      f = reply(sp, out, "C")
+      raise "no answer to #{setting.command.strip}" unless f
+      raise "#{setting.command.strip} answered with #{Setting.from_value(f[1].to_i)}" unless Setting.from_value(f[1].to_i) == setting
+      period = [setting.sequence_us / 1000.0, line_ms].max.ceil
+      sp.write("F#{period}\n")
+      f = reply(sp, out, "F")
+      raise "no answer to F#{period}" unless f
+      $stderr.puts "#{setting}: sample period #{f[1]} ms"
+      count = 0
+      while count < n + SETTLE && (line = sp.gets)
+        out.write(line)
+        count += 1 if Stream.parse(line)[0] == :sample
+        $stderr.print "\r#{setting}: #{count}/#{n + SETTLE}"
+      end
+      $stderr.puts
+    end
+    sp.write("F100\n")
+    $stderr.puts "no answer to F100, the sample period is not back to 100 ms" unless reply(sp, out, "F")
+    sp.close
+    out.close
+    from_file(save)
+  end
+
+  def self.report(rows, spec_rms)
+    puts format("%-22s %10s %10s %8s %8s %10s %10s", "setting", "conv Hz", "sample Hz", "rms", "p-p", "adev(1)", "adev(10)")
+    rows.each do |r|
+      puts format("%-22s %10.1f %10s %8.2f %8d %10.2f %10s", r[:setting], r[:conversion_rate],
+                  r[:sample_rate] ? format("%.1f", r[:sample_rate]) : "-", r[:rms], r[:pp], r[:adev1] || 0,
+                  r[:adev10] ? format("%.2f", r[:adev10]) : "-")
+    end
+    good = rows.select { |r| r[:rms] <= spec_rms }
+    # equal sample rates happen when the serial link is the limit, then the quieter one wins
+    best = good.max_by { |r| [(r[:sample_rate] || r[:conversion_rate]).round(1), -r[:rms]] }
+    if rows.any? { |r| r[:sample_rate] && r[:sample_rate] < 0.9 * r[:conversion_rate] }
+      puts "sample Hz below conv Hz: the loop (I2C delays, serial baud rate) is slower than the chip"
+    end
+    puts best ? "fastest setting with rms <= #{spec_rms}: #{best[:setting]} (#{best[:setting].command.strip})" : "no setting meets rms <= #{spec_rms}"
+  end
+end
+
+if __FILE__ == $0
+  opt = ->(name, default) { (i = ARGV.index(name)) ? ARGV[i + 1] : default }
+  spec = opt.call("--rms", "4").to_f
+  n = opt.call("--samples", "500").to_i
+  rows = case ARGV[0]
+         when "simulate" then Characterize.simulate(n)
+         when "file" then Characterize.from_file(ARGV[1])
+         when "live" then Characterize.live(ARGV[1], (ARGV[2] =~ /\A\d+\z/ ? ARGV[2] : 9600).to_i, n, opt.call("--save", nil))
+         end
+  if rows.nil?
+    puts 'usage: characterize.rb simulate|live PORT [baud]|file capture.txt [--rms CODES] [--samples N] [--save FILE]'
+  elsif rows.empty?
+    puts "no samples"
+  else
+    Characterize.report(rows, spec)
+  end
+end
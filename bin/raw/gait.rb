@@ -0,0 +1,204 @@
+#!/bin/ruby
+# Streaming heel-strike / toe-off detector, same state machine as gaitFeed()
+# in test.cpp. monitor.rb runs it on every sample as it arrives; this file can
+# also replay a recording to measure latency and accuracy.
+#
+# usage: gait.rb replay recording.txt [period_ms]
+#        gait.rb simulate recording.txt [period_ms] [steps]
+#        gait.rb bus [name]
+require_relative 'stream'
+
+class GaitDetector
+  ON_THRESHOLD = 400      # codes above baseline for heel-strike
+  OFF_MIN = 150           # lowest toe-off level
+  OFF_RATIO = 0.25        # toe-off level = step peak * OFF_RATIO
+  BASELINE_WEIGHT = 1.0 / 32
+  MIN_STATE_MS = 80       # refractory time between two events
+
+  Event = Struct.new(:type, :t_ms, :detected_ms)
+
+  def initialize(polarity = 1)
+    @polarity = polarity
+    @baseline = nil
+    @stance = false
+  end
+
+  # feed one sample, returns an Event or nil. O(1) work and state
+  def feed(t_ms, raw_load)
+    load = @polarity * raw_load
+    if @baseline.nil?
+      @baseline = load.to_f
+      @prev = 0.0
+      @prev_ms = t_ms
+      @edge_ms = t_ms
+      return nil
+    end
+
+    x = load - @baseline
+    slope = x - @prev
+    settled = (t_ms - @edge_ms) >= MIN_STATE_MS
+    event = nil
+
+    if !@stance
+      if settled && x > ON_THRESHOLD && slope > 0
+        event = Event.new(:HS, crossing(x, ON_THRESHOLD, t_ms), t_ms)
+        @stance = true
+        @peak = x
+      else
+        @baseline += (load - @baseline) * BASELINE_WEIGHT
+      end
+    else
+      @peak = x if x > @peak
+      off = [@peak * OFF_RATIO, OFF_MIN].max
+      if settled && x < off && slope < 0
+        event = Event.new(:TO, crossing(x, off, t_ms), t_ms)
+        @stance = false
+      end
+    end
+
+    @edge_ms = t_ms if event
+    @prev = x
+    @prev_ms = t_ms
+    event
+  end
+
+  private
+
+  def crossing(x, level, t_ms)
+    return t_ms if x == @prev
+    @prev_ms + (t_ms - @prev_ms) * (level - @prev) / (x - @prev)
+  end
+end
+
+# Offline reference: sees the whole session, so it can use a global baseline,
+# a centred smoothing window and the true peak of every step.
+def reference_events(times, loads, polarity = 1)
+  x = loads.map { |l| polarity * l }
+  base = x.sort[x.length / 10]
+  smooth = x.each_index.map do |i|
+    w = x[[i - 1, 0].max..[i + 1, x.length - 1].min]
+    w.sum.to_f / w.length - base
+  end
+  events = []
+  i = 1
+  while i < smooth.length
+    if smooth[i - 1] <= GaitDetector::ON_THRESHOLD && smooth[i] > GaitDetector::ON_THRESHOLD
+      events << [:HS, interp(times, smooth, i, GaitDetector::ON_THRESHOLD)]
+      j = i
+      j += 1 while j < smooth.length && smooth[j] > GaitDetector::OFF_MIN
+      k = (i...j).max_by { |n| smooth[n] } || i
+      off = [smooth[k] * GaitDetector::OFF_RATIO, GaitDetector::OFF_MIN].max
+      k += 1 while k < smooth.length && smooth[k] >= off
+      break if k >= smooth.length
+      events << [:TO, interp(times, smooth, k, off)]
+      i = k
+    end
+    i += 1
+  end
+  events
+end
+
+def interp(times, y, i, level)
+  return times[i] if y[i] == y[i - 1]
+  times[i - 1] + (times[i] - times[i - 1]) * (level - y[i - 1]) / (y[i] - y[i - 1])
+end
+
+def replay(path, period_ms)
+  times = []
+  loads = []
+  Stream.each_recorded(path, period_ms) do |s|
+    times << s.t_ms
+    loads << Stream.load(s)
+  end
+
+  detector = GaitDetector.new
+  found = []
+  start = Process.clock_gettime(Process::CLOCK_MONOTONIC)
+  times.each_index do |i|
+    e = detector.feed(times[i], loads[i])
+    found << e if e
+  end
+  cpu_us = (Process.clock_gettime(Process::CLOCK_MONOTONIC) - start) * 1e6
+
+  reference = reference_events(times, loads)
+  tolerance = 2 * period_ms + GaitDetector::MIN_STATE_MS
+  latency = []
+  error = []
+  matched = 0
+  reference.each do |type, t|
+    e = found.find { |f| f.type == type && (f.t_ms - t).abs <= tolerance }
+    next unless e
+    matched += 1
+    found.delete(e)
+    latency << e.detected_ms - t
+    error << (e.t_ms - t).abs
+  end
+
+  puts "samples:            #{times.length} (#{period_ms} ms period)"
+  puts "cpu per sample:     #{format('%.2f', cpu_us / [times.length, 1].max)} us"
+  puts "reference events:   #{reference.length}"
+  puts "matched:            #{matched}"
+  puts "missed:             #{reference.length - matched}"
+  puts "extra:              #{found.length}"
+  puts "latency p50/p99/max #{format('%.1f / %.1f / %.1f', Stream.percentile(latency, 0.5), Stream.percentile(latency, 0.99), latency.max || 0)} ms"
+  puts "time error p50/max  #{format('%.1f / %.1f', Stream.percentile(error, 0.5), error.max || 0)} ms"
+  puts "latency budget 20 ms: #{(latency.max || 0) <= 20 ? 'met' : 'NOT met'}"
+end
+
+# live on the sample bus, events in board ms like the E lines from the board;
+# the delay column is how long after the publisher read the sample it was found
+def bus(name)
+  require_relative 'samplebus'
+  detector = GaitDetector.new
+  unwrap = Stream::Unwrap.new
+  SampleBus::Reader.new(name).each do |slot|
+    next unless slot.sample
+    s = slot.sample
+    t_ms = s.board_us ? unwrap.call(s.board_us) / 1000.0 : slot.host_ms
+    e = detector.feed(t_ms, Stream.load(s))
+    next unless e
+    delay = Process.clock_gettime(Process::CLOCK_MONOTONIC, :float_millisecond) - slot.host_ms
+    puts "E\t#{e.type}\t#{e.t_ms.round}\t#{format('%.2f', delay)}"
+    $stdout.flush
+  end
+end
+
+# synthetic walk: half-sine stance loads with noise and slow baseline drift
+def simulate(path, period_ms, steps)
+  rng = Random.new(1)
+  t = 0
+  File.open(path, 'w') do |f|
+    steps.times do
+      swing = 400 + rng.rand(100)
+      stance = 600 + rng.rand(150)
+      peak = 2500 + rng.rand(1000)
+      ((swing + stance) / period_ms).to_i.times do |i|
+        ms = i * period_ms
+        force = ms < swing ? 0 : peak * Math.sin(Math::PI * (ms - swing) / stance)
+        drift = 30 * Math.sin(t / 20000.0)
+        base = 20000 + drift + rng.rand(-20.0..20.0)
+        split = [0.5, 0.3, 0.2].map { |w| (base / 3 + force * w).round }
+        f.puts split.join("\t")
+        t += period_ms
+      end
+    end
+  end
+end
+
+if __FILE__ == $0
+  action = ARGV[0]
+  path = ARGV[1]
+  period = (ARGV[2] || 100).to_f
+  case action
+  when "replay"
+    replay(path, period)
+  when "simulate"
+    simulate(path, period, (ARGV[3] || 50).to_i)
+  when "bus"
+    bus(path || "/adcap0")
+  else
+    puts 'usage: gait.rb replay recording.txt [period_ms]'
+    puts '       gait.rb simulate recording.txt [period_ms] [steps]'
+    puts '       gait.rb bus [name]     live, on the samples of a running samplebus_publish'
+  end
+end
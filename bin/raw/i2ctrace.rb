@@ -0,0 +1,188 @@
+#!/bin/ruby
+# Reads the I2C trace the board prints when I2C_TRACE is set in test.cpp.
+#
+# usage: i2ctrace.rb capture PORT trace.txt [baud]   ask the board for its trace
+#        i2ctrace.rb show trace.txt                   one line per transaction
+#        i2ctrace.rb stats trace.txt                  bus traffic numbers
+#        i2ctrace.rb diff golden.txt trace.txt        byte-exact compare, exit 1 if different
+#        i2ctrace.rb replay trace.txt [-L] [-R]       run the driver in test.cpp against the trace
+#                                                     (host/trace_replay), exit 1 if it differs
+#        i2ctrace.rb model trace.txt                  check the trace against a register model
+#        i2ctrace.rb metrics trace.txt history.csv    add the stats to a history file
+
+module I2cTrace
+  Entry = Struct.new(:op, :device, :register, :data, :status, :us)
+
+  # bytes on the bus: address + 2 register bytes + 2 data bytes, a read sends
+  # the address again after the repeated start
+  BUS_BYTES = { "W" => 5, "R" => 6 }
+  BUS_CLOCK_HZ = 100000
+  NO_DATA = 0x80
+  STATUS = { 0 => "ok", 1 => "too long", 2 => "addr nack", 3 => "data nack", 4 => "error", 5 => "timeout" }
+
+  # register names from the #defines at the top of test.cpp
+  def self.register_names(source = "test.cpp")
+    names = {}
+    return names unless File.exist?(source)
+    File.foreach(source) do |line|
+      break if line.start_with?("/*")
+      names[$2.hex] ||= $1 if line =~ /^#define\s+(\w+)\s+(0x\h+)/ && $1 != "AD7147_ADDR"
+    end
+    names
+  end
+
+  # returns [transactions since reset, entries, transactions before the first
+  # sample] of the last dump in the file. The entries are the kept startup part
+  # and then the ring, so the time jumps between the two
+  def self.load(path)
+    total = nil
+    startup = nil
+    entries = []
+    last_t = nil
+    us = 0
+    File.foreach(path) do |line|
+      f = line.strip.split("\t")
+      if f[0] == "T" && f[1] != "end"
+        total = f[1].to_i
+        startup = f[3] && f[3].to_i
+        entries = []
+        last_t = nil
+      elsif f[0] == "I" && f.length >= 7
+        t = f[6].hex
+        us += ((t - last_t) & 0xFFFF) * 8 if last_t   # 16 bit time in 8 us steps
+        last_t = t
+        entries << Entry.new(f[1], f[2].hex, f[3].hex, f[4].hex, f[5].hex, us)
+      end
+    end
+    [total, entries, startup]
+  end
+
+  def self.status_text(status)
+    text = STATUS[status & 0x7F] || status.to_s
+    status & NO_DATA != 0 ? "#{text}, no data" : text
+  end
+
+  def self.show(entries, names)
+    entries.each do |e|
+      if e.op == "M"
+        puts format("%10.3f ms  -- sample --", e.us / 1000.0)
+        next
+      end
+      name = names[e.register] || format("0x%03X", e.register)
+      puts format("%10.3f ms  %s %-26s 0x%04X  %016b  %s", e.us / 1000.0, e.op, name, e.data, e.data, status_text(e.status))
+    end
+  end
+
+  # startup_total comes from the dump; traces from before the firmware kept the
+  # startup part only have it if nothing fell out of the ring
+  def self.stats(total, entries, startup_total = nil)
+    marks = entries.each_index.select { |i| entries[i].op == "M" }
+    complete = total == entries.count { |e| e.op != "M" }
+    startup = startup_total || (complete ? (marks.first || entries.length) : nil)
+    samples = marks.each_cons(2).map { |a, b| entries[(a + 1)...b] }
+    per_sample = samples.map(&:length)
+    bytes = samples.map { |s| s.sum { |e| BUS_BYTES[e.op] } }
+    busy = marks.each_cons(2).map { |a, b| entries[b - 1].us - entries[a].us }
+    {
+      "transactions" => total,
+      "startup transactions" => startup,
+      "transactions per sample" => per_sample.max,
+      "bus bytes per sample" => bytes.max,
+      "bus time per sample us" => bytes.max && (bytes.max * 9 * 1e6 / BUS_CLOCK_HZ).round,
+      "measured time per sample us" => busy.max,
+      "errors" => entries.count { |e| e.op != "M" && e.status != 0 }
+    }
+  end
+
+  # compares what went over the bus, not when
+  def self.diff(golden, trace, names)
+    a = golden.reject { |e| e.op == "M" }
+    b = trace.reject { |e| e.op == "M" }
+    bad = 0
+    [a.length, b.length].max.times do |i|
+      x = a[i] && a[i].to_a[0, 5]
+      y = b[i] && b[i].to_a[0, 5]
+      next if x == y
+      bad += 1
+      next if bad > 10
+      fmt = ->(e) { e ? "#{e[0]} #{names[e[2]] || format('0x%03X', e[2])} 0x#{format('%04X', e[3])} #{status_text(e[4])}" : "(none)" }
+      puts "##{i}: expected #{fmt.call(x)}, got #{fmt.call(y)}"
+    end
+    gaps = ->(t) { t.each_cons(2).map { |p, q| q.us - p.us } }
+    ga = gaps.call(a)
+    gb = gaps.call(b)
+    unless ga.empty? || gb.empty?
+      puts format("mean time between transactions: %.0f us -> %.0f us", ga.sum.to_f / ga.length, gb.sum.to_f / gb.length)
+    end
+    puts bad == 0 ? "identical (#{a.length} transactions)" : "#{bad} of #{[a.length, b.length].max} transactions differ"
+    bad
+  end
+
+  # plays the trace into a model of the register file: a register read back
+  # after a write must return what was written (result registers change by
+  # themselves and are only reported)
+  def self.model(entries, names)
+    regs = {}
+    bad = 0
+    entries.each do |e|
+      next if e.op == "M" || e.status != 0
+      if e.op == "W"
+        regs[e.register] = e.data
+      elsif regs.key?(e.register) && regs[e.register] != e.data
+        bad += 1
+        puts format("%s wrote 0x%04X, read back 0x%04X", names[e.register] || format("0x%03X", e.register), regs[e.register], e.data)
+      end
+    end
+    puts bad == 0 ? "register model consistent" : "#{bad} read-backs differ from the written value"
+    bad
+  end
+end
+
+if __FILE__ == $0
+  action = ARGV[0]
+  names = I2cTrace.register_names
+  case action
+  when "capture"
+    require_relative 'samplebus'
+    sp = SampleBus.port(ARGV[1], (ARGV[3] || 9600).to_i)
+    sp.write("T\n")
+    File.open(ARGV[2], "w") do |f|
+      dumping = false
+      while (line = sp.gets)
+        dumping ||= line.start_with?("T\t")
+        f.write(line) if dumping
+        break if line.strip == "T\tend"
+      end
+    end
+    sp.close
+  when "show"
+    I2cTrace.show(I2cTrace.load(ARGV[1])[1], names)
+  when "stats"
+    I2cTrace.stats(*I2cTrace.load(ARGV[1])).each { |k, v| puts "#{k}: #{v.nil? ? 'n/a' : v}" }
+  when "diff"
+    exit(I2cTrace.diff(I2cTrace.load(ARGV[1])[1], I2cTrace.load(ARGV[2])[1], names) == 0 ? 0 : 1)
+  when "replay"
+    harness = File.expand_path("../../host/trace_replay", __dir__)
+    unless File.executable?(harness)
+      puts "build the harness first, from the top of the repository:"
+      puts "  g++ -O2 -std=c++17 -I host/stub -o host/trace_replay host/trace_replay.cpp"
+      exit 2
+    end
+    exec(harness, *ARGV[1..])
+  when "model"
+    exit(I2cTrace.model(I2cTrace.load(ARGV[1])[1], names) == 0 ? 0 : 1)
+  when "metrics"
+    stats = I2cTrace.stats(*I2cTrace.load(ARGV[1]))
+    new_file = !File.exist?(ARGV[2])
+    File.open(ARGV[2], "a") do |f|
+      f.puts((["date", "trace"] + stats.keys).join(",")) if new_file
+      f.puts(([Time.now.strftime("%Y-%m-%d %H:%M"), File.basename(ARGV[1])] + stats.values).join(","))
+    end
+  else
+    puts 'usage: i2ctrace.rb capture PORT trace.txt [baud]'
+    puts '       i2ctrace.rb show|stats|model trace.txt'
+    puts '       i2ctrace.rb replay trace.txt [-L] [-R]'
+    puts '       i2ctrace.rb diff golden.txt trace.txt'
+    puts '       i2ctrace.rb metrics trace.txt history.csv'
+  end
+end
@@ -0,0 +1,274 @@
+#!/bin/ruby
+# Measures how long a sample takes from the end of the AD7147 conversion to a
+# host program having it, split into the stages of the pipeline:
+#
+#   conversion -> read     I2C reads of the results (readByte and its 1 ms delays)
+#   read -> queued         formatting, Serial.print into the transmit buffer
+#   queued -> sent         the bytes going out of the UART at the baud rate
+#   sent -> host           USB-serial adapter (latency timer) and the OS
+#   host parse             from gets returning to the parsed sample
+#   total                  conversion to parsed sample
+#
+# The board runs with L1 (LATENCY_PROBE in test.cpp) and reports its own time
+# stamps; the board clock is put on the host clock with the ping fit from
+# sync.rb, at the end of the run so every sample gets the fit over all pings.
+# The simulator knows the true times and simulate prints how far off the host
+# side stages are.
+#
+# usage: latency.rb live PORT [baud] [seconds]
+#        latency.rb simulate [seconds] [baud] [period_ms]
+#                board simulator on a pseudo terminal (Linux), by default with the
+#                baud rate and sample period test.cpp uses
+require_relative 'sync'
+
+class LatencyProbe
+  STAGES = ["conversion -> read", "read -> queued", "queued -> sent", "sent -> host", "host parse", "total"]
+
+  def initialize(warmup_ms, baud)
+    @synced = SyncedBoards.new(1, baud, bucket: PING_BUCKET)
+    @clock = @synced.clocks[0]
+    @pending = {}
+    @records = []
+    @warmup_ms = warmup_ms
+    @start = LatencyProbe.now_ms
+  end
+
+  def self.now_ms
+    Process.clock_gettime(Process::CLOCK_MONOTONIC, :float_millisecond)
+  end
+
+  def ping
+    @synced.ping(0, LatencyProbe.now_ms)
+  end
+
+  # arrival_ms = when gets returned the line
+  def line(text, arrival_ms)
+    kind, value = Stream.parse(text)
+    delivered_ms = LatencyProbe.now_ms
+    case kind
+    when :sample
+      @pending[value.board_us] = [arrival_ms, delivered_ms] if value.board_us
+      @pending.shift while @pending.length > 16
+    when :ping
+      @synced.line(0, text, arrival_ms)
+    when :latency
+      record(value[1, 4].map(&:to_i), @pending.delete(value[1].to_i))
+    end
+  end
+
+  # truth: conversion board us => [true conversion, true sent] host ms, from the simulator
+  def report(truth = nil)
+    n = @records.length
+    puts "samples measured: #{n}"
+    return if n == 0 || !@clock.ready?
+    @times = Hash.new { |h, k| h[k] = [] }
+    @records.each { |board, host| add_times(board, host) }
+    puts format("%-20s %9s %9s %9s", "stage (ms)", "p50", "p99", "max")
+    STAGES.each do |s|
+      v = @times[s]
+      puts format("%-20s %9.2f %9.2f %9.2f", s, Stream.percentile(v, 0.5), Stream.percentile(v, 0.99), v.max)
+    end
+    puts format("clock fit: drift %.1f ppm, residual %.3f ms, min round trip %.2f ms", @clock.drift_ppm, @clock.residual_ms, @clock.min_rtt_ms)
+    STAGES.each { |s| histogram(s, @times[s]) }
+    compare(truth) if truth
+  end
+
+  private
+
+  # the host side stages against the true times; the board side ones are all
+  # on the board clock and need no fit
+  def compare(truth)
+    known = @records.select { |board, _| truth.key?(board[0]) }
+    return if known.empty?
+    fit_error = known.map { |board, _| to_host(board[3]) - truth[board[0]][1] }
+    real = { "sent -> host" => known.map { |board, host| host[0] - truth[board[0]][1] },
+             "total" => known.map { |board, host| host[1] - truth[board[0]][0] } }
+    puts "against the simulator (#{known.length} samples):"
+    puts format("%-20s %9s %9s %9s", "(ms)", "p50", "p99", "max")
+    puts format("%-20s %9.2f %9.2f %9.2f", "fit error", Stream.percentile(fit_error, 0.5), Stream.percentile(fit_error, 0.99), fit_error.max_by(&:abs))
+    real.each do |s, v|
+      puts format("%-20s %9.2f %9.2f %9.2f", "true #{s}", Stream.percentile(v, 0.5), Stream.percentile(v, 0.99), v.max)
+    end
+  end
+
+  def to_host(us)
+    @clock.to_host(@clock.board_ms(us))
+  end
+
+  # 20 bins from the lowest to the highest value, sent -> host can be below 0
+  # by the clock fit error
+  def histogram(stage, v)
+    lo = v.min
+    width = [(v.max - lo) / 20.0, 0.01].max
+    bins = v.group_by { |t| [((t - lo) / width).floor, 19].min }
+    puts "#{stage} histogram:"
+    (0..bins.keys.max).each do |b|
+      count = (bins[b] || []).length
+      puts format("%8.2f-%-8.2f ms %6d %s", lo + b * width, lo + (b + 1) * width, count, "#" * (60.0 * count / v.length).ceil)
+    end
+  end
+
+  # board_ms() unwraps in arrival order, so the board times go through it now
+  def record(board, host)
+    return unless host && LatencyProbe.now_ms - @start > @warmup_ms
+    board.each { |us| @clock.board_ms(us) }
+    @records << [board, host]
+  end
+
+  def add_times(board, host)
+    conversion, read, queued, sent = board
+    arrival, delivered = host
+    diff = ->(a, b) { ((b - a) % (1 << 32)) / 1000.0 }
+    @times["conversion -> read"] << diff.call(conversion, read)
+    @times["read -> queued"] << diff.call(read, queued)
+    @times["queued -> sent"] << diff.call(queued, sent)
+    @times["sent -> host"] << arrival - to_host(sent)
+    @times["host parse"] << delivered - arrival
+    @times["total"] << delivered - to_host(conversion)
+  end
+end
+
+# Every ping reply is about 20 characters, 21 ms of the UART at 9600 baud, where
+# a sample line and its L line already take 75 ms of each 100 ms period. With
+# pings this far apart a fit point is kept every PING_BUCKET pings (1 s)
+PING_MS = 250
+PING_BUCKET = 4
+
+# reads lines on one thread, pings from this one
+def run_probe(input, output, seconds, baud, truth = nil)
+  probe = LatencyProbe.new(5000, baud)
+  lock = Mutex.new
+  reader = Thread.new do
+    while (text = input.gets)
+      arrival = input.respond_to?(:arrival_ms) ? input.arrival_ms : LatencyProbe.now_ms
+      lock.synchronize { probe.line(text, arrival) }
+    end
+  end
+  output.write("L1\n")
+  output.flush
+  finish = LatencyProbe.now_ms + seconds * 1000
+  while LatencyProbe.now_ms < finish
+    output.write(lock.synchronize { probe.ping })
+    output.flush
+    sleep PING_MS / 1000.0
+  end
+  output.write("L0\n")
+  output.flush
+  reader.kill
+  lock.synchronize { probe.report(truth) }
+end
+
+# Pretends to be the board in LATENCY_PROBE mode behind a USB-serial adapter:
+# a conversion every period_ms, 3 results read at ~1.3 ms each, the lines sent
+# one after the other through one UART at the baud rate and the adapter passing
+# bytes on every 16 ms.
+class BoardSim
+  def initialize(io, baud, period_ms, latency_timer_ms = 16.0)
+    @io = io
+    @baud = baud
+    @period = period_ms
+    @timer = latency_timer_ms
+    @queue = []
+    @lock = Mutex.new
+    @uart_free_ms = 0
+    @t0 = LatencyProbe.now_ms
+    @offset_us = 123456789
+    @truth = {}
+  end
+
+  # conversion board us => [conversion, sent] on the host clock
+  attr_reader :truth
+
+  def board_us(host_ms)
+    (((host_ms - @t0) * 1000 * (1 + 30e-6)).to_i + @offset_us) & 0xFFFFFFFF
+  end
+
+  def start
+    [Thread.new { adapter }, Thread.new { commands }, Thread.new { board }]
+  end
+
+  private
+
+  # the line goes out once the UART is done with the ones before it, returns when
+  # its last byte has left; the adapter gets it then
+  def send(text, ready_ms)
+    @lock.synchronize do
+      done_ms = [ready_ms, @uart_free_ms].max + wire_ms(text, @baud)
+      @uart_free_ms = done_ms
+      @queue << [done_ms, text]
+      done_ms
+    end
+  end
+
+  def adapter
+    loop do
+      now = LatencyProbe.now_ms
+      sleep(@timer / 1000.0 - (now - @t0) % @timer / 1000.0)
+      now = LatencyProbe.now_ms
+      out = @lock.synchronize do
+        ready = @queue.take_while { |t, _| t <= now }
+        @queue.shift(ready.length)
+        ready.map(&:last).join
+      end
+      @io.write(out) unless out.empty?
+      @io.flush
+    end
+  end
+
+  def commands
+    while (text = @io.gets)
+      if text.start_with?("P")
+        received = LatencyProbe.now_ms + wire_ms(text, @baud)     # the board sees the last byte after this
+        sleep_until(received)
+        send("Y\t#{text[1..].to_i}\t#{board_us(received)}\r\n", received)
+      end
+    end
+  end
+
+  def board
+    next_ms = LatencyProbe.now_ms
+    loop do
+      next_ms += @period
+      sleep_until(next_ms + 1.2 * rand)                 # conversion seen at the next status poll
+      conversion = LatencyProbe.now_ms
+      sleep_until(conversion + 3.6 + 0.3 * rand)        # three readByte calls
+      read = LatencyProbe.now_ms
+      sample = "30000\t30010\t29990\t#{board_us(conversion)}\n"
+      queued = read + 0.15
+      sent = send(sample, queued)
+      sleep_until(sent)                                 # Serial.flush()
+      @truth[board_us(conversion)] = [conversion, sent]
+      send("L\t#{board_us(conversion)}\t#{board_us(read)}\t#{board_us(queued)}\t#{board_us(sent)}\r\n", sent)
+    end
+  end
+
+  def sleep_until(ms)
+    d = ms - LatencyProbe.now_ms
+    sleep(d / 1000.0) if d > 0
+  end
+end
+
+if __FILE__ == $0
+  case ARGV[0]
+  when "live"
+    require_relative 'samplebus'
+    baud = (ARGV[2] || 9600).to_i
+    sp = SampleBus.port(ARGV[1], baud)
+    run_probe(sp, sp, (ARGV[3] || 30).to_i, baud)
+  when "simulate"
+    require "pty"
+    require "io/console"
+    master, slave = PTY.open
+    slave.raw!
+    baud, period_ms = firmware_timing
+    baud = ARGV[2].to_i if ARGV[2]
+    period_ms = ARGV[3].to_f if ARGV[3]
+    puts "simulating #{baud} baud, #{period_ms} ms sample period"
+    sim = BoardSim.new(master, baud, period_ms)
+    sim.start
+    run_probe(slave, slave, (ARGV[1] || 30).to_i, baud, sim.truth)
+  else
+    puts 'usage: latency.rb live PORT [baud] [seconds]'
+    puts '       latency.rb simulate [seconds] [baud] [period_ms]'
+  end
+end
@@ -2,6 +2,7 @@
  
 require "serialport"
 require 'rubyserial'
+require_relative 'gait'
 print "\nPress CTRL+C or the X to Close\n"
 def seach_ports
   ports = []
@@ -53,11 +54,21 @@ print "\n>>>>>>>>>>"
 print port_str.upcase
 print "<<<<<<<<<<\n"
 #just read forever
+#every sample also goes through the gait detector, events are printed as soon as they are found
+#the detector runs on the board time column, arrival time on the PC is bunched up by the
+#USB-serial adapter; event times are then board ms, like the E lines from the board
+gait = GaitDetector.new
+unwrap = Stream::Unwrap.new
 
 while true
    while (i = sp.gets) do 
       puts i
       #puts i.class #String
+      kind, sample = Stream.parse(i)
+      next unless kind == :sample
+      t_ms = sample.board_us ? unwrap.call(sample.board_us) / 1000.0 : Process.clock_gettime(Process::CLOCK_MONOTONIC, :float_millisecond)
+      event = gait.feed(t_ms, Stream.load(sample))
+      puts "E\t#{event.type}\t#{event.t_ms.round}" if event
     end
 end
 	sp.close      
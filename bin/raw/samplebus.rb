@@ -0,0 +1,187 @@
+#!/bin/ruby
+# Reads the sample bus (host/samplebus.h) from Ruby, so the host tools can run
+# next to samplebus_publish instead of opening the serial port themselves.
+#
+# The ring is read with pread from /dev/shm/<name>, the same memory the C++
+# readers map, with the same per-slot sequence check (see samplebus.h). There
+# is no futex wait here, an empty ring is polled every POLL_S.
+# Commands go to the board through the FIFO /tmp/<name>.cmd.
+#
+# Any tool that takes a serial port also takes bus:NAME, e.g.
+#   sync.rb live bus:/adcap0 bus:/adcap1
+#   latency.rb live bus:/adcap0
+#
+# usage: samplebus.rb tail [name]          print what goes over the bus
+#        samplebus.rb send name LINE       send one command to the board
+require_relative 'stream'
+
+module SampleBus
+  MAGIC = 0x53425553
+  VERSION = 2
+  HEADER_BYTES = 32
+  HEAD_OFFSET = 16
+  SAMPLE_OFFSET = 8          # sequence word first
+  SAMPLE_LINE = 1            # BUS_LINE
+  POLL_S = 0.0005
+
+  # one slot: a Stream::Sample or a text line, host_ms on CLOCK_MONOTONIC
+  Slot = Struct.new(:host_ms, :board, :sample, :text)
+
+  def self.shm_path(name)
+    "/dev/shm/#{name.sub(%r{\A/}, '')}"
+  end
+
+  def self.command_path(name)
+    "/tmp/#{name.sub(%r{\A/}, '')}.cmd"
+  end
+
+  # false if no publisher is listening
+  def self.command(name, line)
+    File.open(command_path(name), File::WRONLY | File::NONBLOCK) { |f| f.syswrite(line.chomp + "\n") }
+    true
+  rescue Errno::ENOENT, Errno::ENXIO
+    false
+  end
+
+  # a serial port, or the bus for bus:NAME
+  def self.port(port, baud)
+    return Port.new(port.delete_prefix("bus:")) if port.start_with?("bus:")
+    require "serialport"
+    SerialPort.new(port, baud, 8, 1, SerialPort::NONE)
+  end
+
+  class Reader
+    attr_reader :lost
+
+    def initialize(name = "/adcap0", from_start: false)
+      @name = name
+      @lost = 0
+      sleep 0.2 until open(from_start)   # no publisher yet
+    end
+
+    # next Slot, nil if there is nothing new
+    def read
+      loop do
+        offset = HEADER_BYTES + (@cursor % @capacity) * @slot_bytes
+        raw = @file.pread(@slot_bytes, offset)
+        want = 2 * @cursor + 2
+        seq = raw.unpack1("Q<")
+        if seq == want && @file.pread(8, offset).unpack1("Q<") == want   # not overwritten while copying
+          @cursor += 1
+          return decode(raw)
+        elsif seq < want
+          return nil if head <= @cursor
+          # being written right now
+        else
+          skip_lapped
+        end
+      end
+    end
+
+    # waits for slots, opens the bus again when the publisher restarts
+    def each
+      loop do
+        slot = read
+        if slot
+          yield slot
+        elsif restarted?
+          sleep 0.2 until open(false)
+        else
+          sleep POLL_S
+        end
+      end
+    end
+
+    def restarted?
+      @file.pread(4, 0).unpack1("L<") != MAGIC
+    end
+
+    private
+
+    # false while there is no bus or the publisher has not written its header yet
+    def open(from_start)
+      @file&.close
+      @file = File.open(SampleBus.shm_path(@name), "rb")
+      magic, version, @capacity, @slot_bytes = @file.pread(16, 0).unpack("L<4")
+      return false unless magic == MAGIC
+      raise "#{@name} is a sample bus of version #{version}, this reader is #{VERSION}" unless version == VERSION
+      @cursor = from_start ? [head - @capacity, 0].max : head
+      true
+    rescue Errno::ENOENT, EOFError
+      false
+    end
+
+    def head
+      @file.pread(8, HEAD_OFFSET).unpack1("Q<")
+    end
+
+    def skip_lapped
+      oldest = [head - @capacity + 1, 0].max
+      if oldest > @cursor
+        @lost += oldest - @cursor
+        @cursor = oldest
+      else
+        @lost += 1
+        @cursor += 1
+      end
+    end
+
+    def decode(raw)
+      host_ns, board_us, c0, c1, c2, board, kind, text = raw[SAMPLE_OFFSET..].unpack("Q<L<S<S<S<CCZ*")
+      host_ms = host_ns / 1e6
+      if kind == SAMPLE_LINE
+        Slot.new(host_ms, board, nil, text)
+      else
+        Slot.new(host_ms, board, Stream::Sample.new([c0, c1, c2], host_ms, board_us == 0 ? nil : board_us), nil)
+      end
+    end
+  end
+
+  # reads like a serial port: gets gives the board's lines again (samples in
+  # their text form), write sends commands. arrival_ms is when the publisher
+  # read the last line, a better arrival time than when gets returned
+  class Port
+    attr_reader :arrival_ms
+
+    def initialize(name)
+      @name = name
+      @reader = Reader.new(name)
+    end
+
+    def gets
+      loop do
+        slot = @reader.read
+        if slot
+          @arrival_ms = slot.host_ms
+          return slot.text + "\n" if slot.text
+          s = slot.sample
+          return (s.cdc + [s.board_us].compact).join("\t") + "\n"
+        end
+        sleep POLL_S
+      end
+    end
+
+    def write(text)
+      text.each_line { |line| SampleBus.command(@name, line) unless line.strip.empty? }
+      text.length
+    end
+
+    def flush; end
+    def close; end
+  end
+end
+
+if __FILE__ == $0
+  case ARGV[0]
+  when "tail"
+    SampleBus::Reader.new(ARGV[1] || "/adcap0").each do |slot|
+      puts slot.text ? "#{slot.board}\t#{slot.text}" : "#{slot.board}\t#{(slot.sample.cdc + [slot.sample.board_us]).join("\t")}"
+      $stdout.flush
+    end
+  when "send"
+    exit(SampleBus.command(ARGV[1], ARGV[2]) ? 0 : 1)
+  else
+    puts 'usage: samplebus.rb tail [name]'
+    puts '       samplebus.rb send name LINE'
+  end
+end
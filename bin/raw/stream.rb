@@ -0,0 +1,77 @@
+#!/bin/ruby
+# Shared by the host tools: turns the lines the board prints into samples.
+#
+# Sample line:  cdc0<TAB>cdc1<TAB>cdc2<TAB>board time in us
+# (older recordings have no board time column)
+# Other lines start with a letter tag or are the register dump printed at
+# startup; those are returned as :other.
+#   E  gait event       E<TAB>HS|TO<TAB>ms
+#   Y  ping reply       Y<TAB>seq<TAB>board us
+#   S  sync pulse       S<TAB>count<TAB>board us
+#   L  latency probe    L<TAB>conversion<TAB>read<TAB>queued<TAB>sent (board us)
+
+module Stream
+  Sample = Struct.new(:cdc, :t_ms, :board_us)
+  TAGS = { "E" => :event, "Y" => :ping, "S" => :pulse, "L" => :latency, "U" => :utilization }
+
+  # returns [:sample, Sample] for a sample line, [tag, fields] for a tagged
+  # line (tag from TAGS), [:other, line] for anything else
+  def self.parse(line, t_ms = nil)
+    fields = line.strip.split("\t")
+    return [:other, line] if fields.empty?
+    if fields.all? { |f| f =~ /\A-?\d+\z/ } && fields.length >= 3
+      board_us = fields[3] && fields[3].to_i
+      return [:sample, Sample.new(fields[0, 3].map(&:to_i), t_ms, board_us)]
+    end
+    return [TAGS[fields[0]], fields] if TAGS.key?(fields[0])
+    [:other, line]
+  end
+
+  # load on the insole as used by the gait detector
+  def self.load(sample)
+    sample.cdc.sum
+  end
+
+  def self.percentile(values, p)
+    return 0 if values.empty?
+    s = values.sort
+    s[((s.length - 1) * p).round]
+  end
+
+  # board time is a 32 bit us counter that rolls over every 71.6 minutes,
+  # Unwrap turns it into a count that keeps going up
+  class Unwrap
+    def initialize
+      @last = nil
+      @high = 0
+    end
+
+    def call(us)
+      @high += 1 << 32 if @last && us < @last && @last - us > (1 << 31)
+      @last = us
+      @high + us
+    end
+  end
+
+  # reads a recording (monitor output saved to a file) and yields each sample.
+  # the time is taken from the board time column, or index * period_ms for
+  # recordings made before it existed
+  def self.each_recorded(path, period_ms)
+    index = 0
+    unwrap = Unwrap.new
+    first = nil
+    File.foreach(path) do |line|
+      kind, value = parse(line)
+      next unless kind == :sample
+      if value.board_us
+        us = unwrap.call(value.board_us)
+        first ||= us
+        value.t_ms = (us - first) / 1000.0
+      else
+        value.t_ms = index * period_ms
+      end
+      index += 1
+      yield value
+    end
+  end
+end
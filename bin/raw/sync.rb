@@ -0,0 +1,387 @@
+#!/bin/ruby
+# Puts the samples of several boards (left and right insole) on the host clock
+# and merges them into one stream in time order.
+#
+# Every board time stamps its samples with its own micros(). The host pings
+# each board (P<seq>, answered with Y<TAB>seq<TAB>board us) and notes when the
+# ping left and when the answer came back. The board read its clock somewhere
+# in between, so the middle of the exchange is our best guess of the host time
+# for that board time. USB-serial adapters hold bytes for up to their latency
+# timer (16 ms on FTDI), so most exchanges are useless. The exchanges are put
+# in groups of BUCKET, only the one with the shortest round trip of each group
+# is kept, and a straight line (offset + rate) is fitted through the last
+# BUCKETS of those. The rate absorbs crystal drift, the window lets it follow
+# slow temperature changes. A few points close together give a rate that is
+# mostly noise, so until there are RATE_POINTS over RATE_SPAN_MS the rate stays
+# 1 (the crystal is within 100 ppm). The offset is put through the groups whose
+# round trip is within RTT_SLACK_MS of the fastest only: a group where every
+# reply waited behind a sample line would pull it by half the wait. The middle
+# is only right if both ways take as long:
+# at 9600 baud the Y line spends about 4 times as long on the wire as the P
+# line, so with the baud rate given the difference is taken off first.
+#
+# If the boards share a sync line (SYNC_INT in test.cpp) the pulses arrive on
+# every board at the same instant, so the other boards are fitted directly
+# against the first board, which removes the USB error between boards.
+#
+# usage: sync.rb simulate [seconds] [pulse] [baud] [period_ms]
+#                simulated boards, by default at the baud rate and sample period of test.cpp
+#        sync.rb live PORT_LEFT PORT_RIGHT [baud]
+require_relative 'stream'
+
+# SERIAL_BAUD and SAMPLE_PERIOD_MS of the firmware, 9600 and 100 if it is not found
+def firmware_timing(source = File.expand_path("../../test.cpp", __dir__))
+  baud = 9600
+  period_ms = 100
+  if File.exist?(source)
+    File.foreach(source) do |line|
+      baud = $1.to_i if line =~ /^#define\s+SERIAL_BAUD\s+(\d+)/
+      period_ms = $1.to_i if line =~ /^#define\s+SAMPLE_PERIOD_MS\s+(\d+)/
+    end
+  end
+  [baud, period_ms]
+end
+
+# time a line takes on the wire, 8N1
+def wire_ms(text, baud)
+  text.length * 10 * 1000.0 / baud
+end
+
+class ClockSync
+  BUCKET = 16   # exchanges per group, the fastest one is kept
+  BUCKETS = 64  # groups in the fit
+  RATE_POINTS = 8
+  RATE_SPAN_MS = 30000
+  RTT_SLACK_MS = 2.0  # groups slower than the fastest by more than this waited on the way
+
+  attr_reader :offset_ms, :rate, :residual_ms, :min_rtt_ms
+
+  # bucket: fewer exchanges per group when the pings are far apart
+  def initialize(bucket = BUCKET)
+    @bucket = bucket
+    @best = []
+    @in_bucket = 0
+    @unwrap = Stream::Unwrap.new
+    @rate = 1.0
+    @offset_ms = nil
+    @residual_ms = 0.0
+  end
+
+  # every board time from this board goes through here, in arrival order
+  def board_ms(board_us)
+    @unwrap.call(board_us) / 1000.0
+  end
+
+  def add_exchange(host_sent_ms, board_ms, host_received_ms)
+    exchange = [board_ms, (host_sent_ms + host_received_ms) / 2.0, host_received_ms - host_sent_ms]
+    if @in_bucket == 0
+      @best << exchange
+      @best.shift while @best.length > BUCKETS
+    elsif exchange[2] < @best[-1][2]
+      @best[-1] = exchange
+    end
+    @in_bucket = (@in_bucket + 1) % @bucket
+    fit
+  end
+
+  def ready?
+    !@offset_ms.nil?
+  end
+
+  def to_host(board_ms)
+    @offset_ms + @rate * (board_ms - @x0)
+  end
+
+  # how fast the board clock runs against the host clock
+  def drift_ppm
+    (1.0 / @rate - 1.0) * 1e6
+  end
+
+  private
+
+  def fit
+    @min_rtt_ms = @best.map { |e| e[2] }.min
+    @x0 = @best[0][0]
+    if @best.length < RATE_POINTS || @best[-1][0] - @x0 < RATE_SPAN_MS
+      @rate = 1.0
+    else
+      @rate, = ClockSync.line(@best.map { |e| e[0] - @x0 }, @best.map { |e| e[1] })
+    end
+    good = @best.select { |e| e[2] <= @min_rtt_ms + RTT_SLACK_MS }
+    @offset_ms = good.sum { |e| e[1] - @rate * (e[0] - @x0) } / good.length
+    @residual_ms = Math.sqrt(good.sum { |e| (to_host(e[0]) - e[1])**2 } / good.length)
+  end
+
+  # least squares y = a + b x, returns [b, a]
+  def self.line(x, y)
+    n = x.length.to_f
+    mx = x.sum / n
+    my = y.sum / n
+    sxx = x.sum { |v| (v - mx)**2 }
+    return [1.0, my - mx] if sxx == 0
+    b = x.each_index.sum { |i| (x[i] - mx) * (y[i] - my) } / sxx
+    [b, my - b * mx]
+  end
+end
+
+# maps the board time of another board onto the reference board (board 0)
+# using sync pulses that both of them saw
+class PulseAlign
+  WINDOW = 32
+
+  def initialize
+    @ref = {}
+    @own = {}
+    @pairs = []
+  end
+
+  def add_ref(count, board_ms)
+    @ref[count] = board_ms
+    pair(count)
+  end
+
+  def add_own(count, board_ms)
+    @own[count] = board_ms
+    pair(count)
+  end
+
+  def ready?
+    !@pairs.empty?
+  end
+
+  def to_ref(board_ms)
+    @offset + @rate * (board_ms - @x0)
+  end
+
+  private
+
+  def pair(count)
+    return unless @ref.key?(count) && @own.key?(count)
+    @pairs << [@own.delete(count), @ref.delete(count)]
+    @pairs.shift while @pairs.length > WINDOW
+    @x0 = @pairs[0][0]
+    if @pairs.length < 2
+      @rate, @offset = 1.0, @pairs[0][1]
+    else
+      @rate, @offset = ClockSync.line(@pairs.map { |p| p[0] - @x0 }, @pairs.map { |p| p[1] })
+    end
+  end
+end
+
+# k-way merge of per-board streams that are each already in time order.
+# A sample is let out once every board has something newer queued, or it is
+# older than max_lag_ms (a board stopped sending)
+class Merger
+  def initialize(boards, max_lag_ms)
+    @queues = Array.new(boards) { [] }
+    @max_lag_ms = max_lag_ms
+  end
+
+  def push(board, host_ms, item)
+    @queues[board] << [host_ms, board, item]
+  end
+
+  def pop_ready(now_ms)
+    loop do
+      heads = @queues.reject(&:empty?)
+      break if heads.empty?
+      first = heads.min_by { |q| q[0][0] }
+      break unless heads.length == @queues.length || first[0][0] < now_ms - @max_lag_ms
+      yield first.shift
+    end
+  end
+end
+
+# host side for a set of boards: feed it lines as they arrive, it hands back
+# the merged samples
+class SyncedBoards
+  attr_reader :clocks
+
+  # baud nil: the wire time of the ping lines is left in
+  def initialize(boards, baud = nil, max_lag_ms = 50, bucket: ClockSync::BUCKET)
+    @baud = baud
+    @clocks = Array.new(boards) { ClockSync.new(bucket) }
+    @pulses = Array.new(boards) { PulseAlign.new }
+    @pings = Array.new(boards) { {} }
+    @merger = Merger.new(boards, max_lag_ms)
+    @seq = 0
+  end
+
+  # returns the ping line to send to board and remembers when it went out
+  def ping(board, host_ms)
+    @seq += 1
+    @pings[board][@seq] = host_ms
+    "P#{@seq}\n"
+  end
+
+  # one line received from board at host time host_ms
+  def line(board, text, host_ms)
+    kind, value = Stream.parse(text)
+    case kind
+    when :sample
+      return unless value.board_us
+      t = host_ms(board, @clocks[board].board_ms(value.board_us))
+      @merger.push(board, t, value) if t
+    when :ping
+      sent = @pings[board].delete(value[1].to_i)
+      host_ms += wire_ms("P#{value[1]}\n", @baud) - wire_ms(text, @baud) if @baud
+      @clocks[board].add_exchange(sent, @clocks[board].board_ms(value[2].to_i), host_ms) if sent
+    when :pulse
+      t = @clocks[board].board_ms(value[2].to_i)
+      if board == 0
+        @pulses.drop(1).each { |p| p.add_ref(value[1].to_i, t) }
+      else
+        @pulses[board].add_own(value[1].to_i, t)
+      end
+    end
+  end
+
+  # yields [host_ms, board, sample] in time order
+  def each_merged(now_ms, &block)
+    @merger.pop_ready(now_ms, &block)
+  end
+
+  # host time of a board time, through the sync pulses when there are any
+  def host_ms(board, board_ms)
+    if board > 0 && @pulses[board].ready? && @clocks[0].ready?
+      @clocks[0].to_host(@pulses[board].to_ref(board_ms))
+    elsif @clocks[board].ready?
+      @clocks[board].to_host(board_ms)
+    end
+  end
+end
+
+# Simulated boards: the true time is the host clock, each board clock has its
+# own offset, crystal error and a slow temperature wander. Every line goes out
+# through the board's UART at the baud rate, one after the other, and the
+# adapter sends what it has every 16 ms (latency timer, own phase per adapter).
+# A ping reaches the board when its last byte is through the UART, the board
+# stamps it when the command task reads it.
+class SimBoard
+  LATENCY_TIMER_MS = 16.0
+
+  def initialize(rng, offset_ms, ppm, baud)
+    @rng = rng
+    @offset_ms = offset_ms
+    @ppm = ppm
+    @baud = baud
+    @phase = rng.rand(LATENCY_TIMER_MS)
+    @uart_free_ms = 0.0
+  end
+
+  def board_us(true_ms)
+    wander = 5 * Math.sin(true_ms / 60000.0)   # ppm
+    ms = @offset_ms + true_ms * (1 + (@ppm + wander) * 1e-6)
+    ((ms * 1000).floor / 8 * 8) % (1 << 32)     # micros() steps by 8 us at 8 MHz
+  end
+
+  # host time a line the board starts to print at true_ms arrives; the lines
+  # must come in the order the board prints them
+  def arrival_ms(true_ms, text)
+    @uart_free_ms = [true_ms, @uart_free_ms].max + wire_ms(text, @baud)
+    ticks = ((@uart_free_ms - @phase) / LATENCY_TIMER_MS).ceil
+    @phase + ticks * LATENCY_TIMER_MS + 0.125
+  end
+
+  # true time the board reads a ping the host wrote at sent_ms
+  def ping_read_ms(sent_ms, text)
+    sent_ms + 0.2 + @rng.rand(0.5) + wire_ms(text, @baud) + @rng.rand(1.0)
+  end
+end
+
+def simulate(seconds, pulse, baud, period_ms)
+  puts "simulating #{baud} baud, #{period_ms} ms sample period"
+  rng = Random.new(7)
+  boards = [SimBoard.new(rng, 1234.5, 40, baud), SimBoard.new(rng, 98765.4, -35, baud)]
+  synced = SyncedBoards.new(boards.length, baud)
+  arrivals = []   # [host arrival ms, board, line, [tick ms, true ms] for samples]
+
+  boards.each_with_index do |b, i|
+    printed = []   # [true ms the board prints it, line, ping sent ms or truth]
+    (0...(seconds * 1000)).step(period_ms) do |t|
+      ts = t + i * period_ms / 2.0   # the boards sample out of step
+      printed << [ts + 3.6, "1\t2\t3\t#{b.board_us(ts)}\n", [t, ts]]   # after the three readByte
+      sent = t + rng.rand(period_ms.to_f)   # a ping every period, not in step with the board
+      ping = synced.ping(i, sent)
+      at_board = b.ping_read_ms(sent, ping)
+      printed << [at_board, "Y\t#{ping[1..].to_i}\t#{b.board_us(at_board)}\r\n", nil]
+      printed << [t, "S\t#{t / 1000}\t#{b.board_us(t)}\r\n", nil] if pulse && t % 1000 == 0
+    end
+    printed.sort_by(&:first).each { |at, line, truth| arrivals << [b.arrival_ms(at, line), i, line, truth] }
+  end
+
+  errors = Array.new(boards.length) { {} }
+  merged = []
+  settle_ms = 60000
+  arrivals.each_with_index.sort_by { |a, n| [a[0], n] }.map(&:first).each do |host_ms, board, line, truth|
+    synced.line(board, line, host_ms)
+    if truth && truth[0] > settle_ms   # let the fit settle before scoring
+      _, s = Stream.parse(line)
+      t = synced.host_ms(board, synced.clocks[board].board_ms(s.board_us))
+      errors[board][truth[0]] = t - truth[1] if t
+    end
+    synced.each_merged(host_ms) { |m| merged << m[0] if m[0] > settle_ms }
+  end
+
+  cross = errors[0].keys.select { |k| errors[1].key?(k) }.map { |k| (errors[0][k] - errors[1][k]).abs }
+  boards.each_index do |i|
+    c = synced.clocks[i]
+    e = errors[i].values.map(&:abs)
+    puts "board #{i}: drift #{format('%.1f', c.drift_ppm)} ppm, min rtt #{format('%.2f', c.min_rtt_ms)} ms, " \
+         "error p99 #{format('%.3f', Stream.percentile(e, 0.99))} ms"
+  end
+  puts "cross-board alignment p50/p99/max #{format('%.3f / %.3f / %.3f', Stream.percentile(cross, 0.5), Stream.percentile(cross, 0.99), cross.max)} ms"
+  puts "merged stream out of order: #{merged.each_cons(2).count { |a, b| a > b }} of #{merged.length}"
+  puts "alignment under 1 ms: #{cross.max < 1.0 ? 'yes' : 'NO'}"
+end
+
+# two real boards, prints board<TAB>host ms<TAB>cdc0<TAB>cdc1<TAB>cdc2
+def live(ports, baud)
+  require_relative 'samplebus'
+  synced = SyncedBoards.new(ports.length, baud)
+  lock = Mutex.new
+  clock = -> { Process.clock_gettime(Process::CLOCK_MONOTONIC, :float_millisecond) }
+  serial = ports.map { |p| SampleBus.port(p, baud) }
+
+  serial.each_with_index do |sp, i|
+    Thread.new do
+      while (text = sp.gets)
+        arrival = sp.respond_to?(:arrival_ms) ? sp.arrival_ms : clock.call
+        lock.synchronize { synced.line(i, text, arrival) }
+      end
+    end
+  end
+
+  last_report = clock.call
+  loop do
+    serial.each_with_index { |sp, i| sp.write(lock.synchronize { synced.ping(i, clock.call) }) }
+    sleep 0.1
+    now = clock.call
+    lock.synchronize do
+      synced.each_merged(now) { |t, board, s| puts "#{board}\t#{format('%.3f', t)}\t#{s.cdc.join("\t")}" }
+      if now - last_report > 5000
+        last_report = now
+        r = synced.clocks.map { |c| c.residual_ms }
+        $stderr.puts "drift #{synced.clocks.map { |c| format('%.1f', c.drift_ppm) }.join(' / ')} ppm, " \
+                     "alignment error ~#{format('%.3f', Math.sqrt(r.sum { |v| v * v }))} ms"
+      end
+    end
+  end
+end
+
+if __FILE__ == $0
+  case ARGV[0]
+  when "simulate"
+    baud, period_ms = firmware_timing
+    pulse = ARGV.include?("pulse")
+    rest = ARGV[2..].reject { |a| a == "pulse" }
+    baud = rest[0].to_i if rest[0]
+    period_ms = rest[1].to_f if rest[1]
+    simulate((ARGV[1] || 300).to_i, pulse, baud, period_ms)
+  when "live"
+    live(ARGV[1, 2], (ARGV[3] || 9600).to_i)
+  else
+    puts 'usage: sync.rb simulate [seconds] [pulse] [baud] [period_ms]'
+    puts '       sync.rb live PORT_LEFT PORT_RIGHT [baud]'
+  end
+end
@@ -0,0 +1,343 @@
+//////////////////////////////////////////////////////////////////////////
+///Sample bus: decoded samples in POSIX shared memory (Linux host side)
+
+/*
+Only one program can have the serial port open. samplebus_publish reads the board,
+decodes every line once and puts the samples in a ring in shared memory. Any number of
+programs (plot, recorder, gait feedback) attach to the ring and read the samples straight
+out of the mapping, so a new reader adds no serial traffic and no parsing.
+The other lines from the board (ping replies, sync pulses, events, latency, trace and
+settings replies) go into the same ring as text slots, in the order they arrived.
+Commands for the board go the other way through a FIFO next to the bus (busCommandPath,
+/tmp/<name>.cmd): any program writes whole lines to it, e.g. echo P1 > /tmp/adcap0.cmd,
+and the publisher passes them to the serial port. Lines up to PIPE_BUF bytes are written
+in one piece, so several programs can send commands at the same time.
+bin/raw/samplebus.rb reads the bus from Ruby.
+
+Layout of the shared memory object (/dev/shm/<name>):
+	BusHeader
+	BusSlot[capacity]			capacity is a power of two
+
+One writer, many readers, no locks:
+ - sample number n goes into slot n % capacity
+ - every slot has a sequence word. The writer sets it to 2n+1 before it writes the
+   sample and to 2n+2 after, so a reader that wants sample n knows:
+     seq < 2n+2  not written yet, wait
+     seq = 2n+2  the sample is there, copy it and check seq again after the copy
+     seq > 2n+2  the writer already went around and overwrote it: the reader was too slow
+   (a seqlock per slot)
+ - each reader keeps its own cursor (the next n it wants) in its own memory, so readers
+   never write to the shared memory except the waiter count
+ - a new writer marks the old ring dead (magic 0) and makes a fresh one under the same
+   name; readers check restarted() and open the bus again
+ - a reader with nothing to read sleeps on a futex in the header, the writer only makes
+   the wake system call when someone is sleeping
+
+Build (Linux): g++ -O2 -std=c++17 -o samplebus_publish host/samplebus_publish.cpp
+               g++ -O2 -std=c++17 -o samplebus_tail host/samplebus_tail.cpp
+*/
+#ifndef SAMPLEBUS_H
+#define SAMPLEBUS_H
+
+#include <atomic>
+#include <inttypes.h>
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <time.h>
+#include <stdio.h>
+#include <limits.h>
+
+#define SAMPLEBUS_MAGIC 0x53425553		// "SBUS"
+#define SAMPLEBUS_VERSION 2
+#define SAMPLEBUS_NAME "/adcap0"
+#define SAMPLEBUS_CAPACITY 4096				// slots kept, about 40 s at 100 samples/s
+#define SAMPLEBUS_TEXT 60							// longest text line kept, with the terminating 0
+
+#define BUS_SAMPLE 0			// kind: a decoded sample line
+#define BUS_LINE 1				// kind: any other line from the board, in text
+
+// one line from the board
+struct BusSample {
+	uint64_t hostNs;			// CLOCK_MONOTONIC when the line was read
+	uint32_t boardUs;			// board time column (micros() on the board), 0 if none
+	uint16_t cdc[3];			// CDC_RESULT_S0..S2
+	uint8_t board;				// which board this came from
+	uint8_t kind;					// BUS_SAMPLE or BUS_LINE
+	char text[SAMPLEBUS_TEXT];	// BUS_LINE: the line without the line end, cut to fit
+};
+
+struct BusSlot {
+	std::atomic<uint64_t> seq;
+	BusSample sample;
+};
+
+struct BusHeader {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t capacity;
+	uint32_t slotSize;
+	std::atomic<uint64_t> head;			// next sample number the writer will use
+	std::atomic<uint32_t> wake;			// futex word, changes on every publish
+	std::atomic<uint32_t> waiters;	// readers sleeping on wake
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the ring needs lock free 64 bit atomics");
+// bin/raw/samplebus.rb reads the mapping with these offsets
+static_assert(sizeof(BusHeader) == 32 && offsetof(BusHeader, head) == 16, "header layout");
+static_assert(sizeof(BusSlot) == 88 && offsetof(BusSlot, sample) == 8, "slot layout");
+static_assert(offsetof(BusSample, boardUs) == 8 && offsetof(BusSample, cdc) == 12 && offsetof(BusSample, board) == 18
+		&& offsetof(BusSample, kind) == 19 && offsetof(BusSample, text) == 20, "sample layout");
+
+inline size_t busBytes(uint32_t capacity) {
+	return sizeof(BusHeader) + (size_t)capacity * sizeof(BusSlot);
+}
+
+inline BusSlot *busSlots(BusHeader *h) {
+	return (BusSlot *)(h + 1);
+}
+
+// the command FIFO of a bus: /adcap0 -> /tmp/adcap0.cmd
+inline void busCommandPath(const char *name, char *path, size_t size) {
+	snprintf(path, size, "/tmp/%s.cmd", name[0] == '/' ? name + 1 : name);
+}
+
+// sends one command line to the board behind a bus, false if no publisher is listening
+inline bool busCommand(const char *name, const char *line) {
+	char path[128];
+	busCommandPath(name, path, sizeof(path));
+	int fd = ::open(path, O_WRONLY | O_NONBLOCK);
+	if (fd < 0)
+		return false;
+	char text[PIPE_BUF];
+	int n = snprintf(text, sizeof(text), "%s\n", line);
+	bool ok = n > 0 && n < (int)sizeof(text) && write(fd, text, n) == n;
+	::close(fd);
+	return ok;
+}
+
+inline uint64_t busNowNs() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+inline long busFutex(std::atomic<uint32_t> *word, int op, uint32_t value, const timespec *timeout) {
+	// shared between processes, so not FUTEX_PRIVATE_FLAG
+	return syscall(SYS_futex, (uint32_t *)word, op, value, timeout, NULL, 0);
+}
+
+// tells the readers of a ring that its writer is gone
+inline void busRetire(BusHeader *h) {
+	__atomic_store_n(&h->magic, 0, __ATOMIC_RELEASE);
+	h->wake.fetch_add(1, std::memory_order_release);
+	busFutex(&h->wake, FUTEX_WAKE, INT32_MAX, NULL);
+}
+
+// the single writer, creates (or takes over) the shared memory object
+class BusWriter {
+public:
+	BusWriter() : header(NULL), slots(NULL), mask(0) {}
+
+	~BusWriter() {
+		if (header) {
+			busRetire(header);
+			munmap(header, busBytes(header->capacity));
+		}
+	}
+
+	// returns false and sets errno if the object cannot be made
+	bool open(const char *name = SAMPLEBUS_NAME, uint32_t capacity = SAMPLEBUS_CAPACITY) {
+		if (capacity == 0 || (capacity & (capacity - 1))) {
+			errno = EINVAL;
+			return false;
+		}
+		int fd = shm_open(name, O_RDWR, 0);		// a ring left by an earlier writer
+		if (fd >= 0) {
+			void *old = mmap(NULL, sizeof(BusHeader), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+			if (old != MAP_FAILED) {
+				busRetire((BusHeader *)old);
+				munmap(old, sizeof(BusHeader));
+			}
+			close(fd);
+			shm_unlink(name);
+		}
+		fd = shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+		if (fd < 0)
+			return false;
+		size_t bytes = busBytes(capacity);
+		if (ftruncate(fd, bytes) < 0) {
+			close(fd);
+			return false;
+		}
+		void *p = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		header = (BusHeader *)p;
+		header->version = SAMPLEBUS_VERSION;
+		header->capacity = capacity;
+		header->slotSize = sizeof(BusSlot);
+		slots = busSlots(header);
+		mask = capacity - 1;
+		std::atomic_thread_fence(std::memory_order_release);
+		__atomic_store_n(&header->magic, SAMPLEBUS_MAGIC, __ATOMIC_RELEASE);	// readers wait for this
+		return true;
+	}
+
+	void publish(const BusSample &sample) {
+		uint64_t n = header->head.load(std::memory_order_relaxed);
+		BusSlot &slot = slots[n & mask];
+		slot.seq.store(2 * n + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.sample = sample;
+		slot.seq.store(2 * n + 2, std::memory_order_release);
+		header->head.store(n + 1, std::memory_order_release);
+		header->wake.fetch_add(1, std::memory_order_release);
+		if (header->waiters.load(std::memory_order_acquire))
+			busFutex(&header->wake, FUTEX_WAKE, INT32_MAX, NULL);
+	}
+
+private:
+	BusHeader *header;
+	BusSlot *slots;
+	uint32_t mask;
+};
+
+// one reader; every consumer process has its own and its own cursor
+class BusReader {
+public:
+	BusReader() : header(NULL), slots(NULL), current(NULL), mask(0), bytes(0), cursor(0), lost(0) {}
+
+	~BusReader() {
+		close();
+	}
+
+	void close() {
+		if (header)
+			munmap(header, bytes);
+		header = NULL;
+	}
+
+	// returns false if there is no bus (yet); fromStart = read what is still in the ring
+	bool open(const char *name = SAMPLEBUS_NAME, bool fromStart = false) {
+		close();
+		int fd = shm_open(name, O_RDWR, 0);		// read-write only for the waiter count
+		if (fd < 0)
+			return false;
+		struct stat st;
+		if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(BusHeader)) {
+			::close(fd);
+			errno = EAGAIN;
+			return false;
+		}
+		void *p = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		::close(fd);
+		if (p == MAP_FAILED)
+			return false;
+		BusHeader *h = (BusHeader *)p;
+		if (__atomic_load_n(&h->magic, __ATOMIC_ACQUIRE) != SAMPLEBUS_MAGIC || h->version != SAMPLEBUS_VERSION
+				|| h->slotSize != sizeof(BusSlot) || busBytes(h->capacity) > (size_t)st.st_size) {
+			munmap(p, st.st_size);
+			errno = EPROTO;
+			return false;
+		}
+		header = h;
+		bytes = st.st_size;
+		slots = busSlots(header);
+		mask = header->capacity - 1;
+		uint64_t head = header->head.load(std::memory_order_acquire);
+		cursor = fromStart && head > header->capacity ? head - header->capacity : (fromStart ? 0 : head);
+		return true;
+	}
+
+	// zero-copy look at the next sample: returns NULL if there is none yet.
+	// The pointer is into the shared ring; call done() when finished with it, which
+	// returns false if the writer overwrote the slot meanwhile (the data is then bad)
+	const BusSample *peek() {
+		for (;;) {
+			BusSlot &slot = slots[cursor & mask];
+			uint64_t want = 2 * cursor + 2;
+			uint64_t seq = slot.seq.load(std::memory_order_acquire);
+			if (seq == want) {
+				current = &slot;
+				return &slot.sample;
+			}
+			if (seq < want && header->head.load(std::memory_order_acquire) <= cursor)
+				return NULL;			// not written yet
+			if (seq < want)
+				continue;					// being written right now, it is ours in a moment
+			skipLapped();
+		}
+	}
+
+	bool done() {
+		std::atomic_thread_fence(std::memory_order_acquire);
+		bool ok = current->seq.load(std::memory_order_relaxed) == 2 * cursor + 2;
+		if (ok)
+			cursor++;
+		else
+			skipLapped();
+		return ok;
+	}
+
+	// copying read, returns false if there is nothing new
+	bool read(BusSample &out) {
+		for (;;) {
+			const BusSample *s = peek();
+			if (!s)
+				return false;
+			out = *s;
+			if (done())
+				return true;
+		}
+	}
+
+	// sleeps until the writer publishes something or timeoutMs passes
+	void wait(int timeoutMs) {
+		uint32_t seen = header->wake.load(std::memory_order_acquire);
+		if (header->head.load(std::memory_order_acquire) > cursor)
+			return;
+		timespec ts = { timeoutMs / 1000, (long)(timeoutMs % 1000) * 1000000 };
+		header->waiters.fetch_add(1, std::memory_order_acq_rel);
+		busFutex(&header->wake, FUTEX_WAIT, seen, &ts);
+		header->waiters.fetch_sub(1, std::memory_order_acq_rel);
+	}
+
+	// the writer was restarted and the ring started over, open() again
+	bool restarted() const { return __atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SAMPLEBUS_MAGIC; }
+
+	uint64_t lostSamples() const { return lost; }
+	uint64_t position() const { return cursor; }
+
+private:
+	// the writer went around the ring past us: jump to the oldest sample still there
+	void skipLapped() {
+		uint64_t head = header->head.load(std::memory_order_acquire);
+		uint64_t oldest = head > header->capacity ? head - header->capacity + 1 : 0;
+		if (oldest > cursor) {
+			lost += oldest - cursor;
+			cursor = oldest;
+		}
+		else {
+			lost++;
+			cursor++;
+		}
+	}
+
+	BusHeader *header;
+	BusSlot *slots;
+	BusSlot *current;
+	uint32_t mask;
+	size_t bytes;
+	uint64_t cursor;
+	uint64_t lost;
+};
+
+#endif
@@ -0,0 +1,165 @@
+//////////////////////////////////////////////////////////////////////////
+///Reads one board and publishes its samples on the sample bus (see samplebus.h)
+
+/*
+usage: samplebus_publish <serial port or -> [baud] [board number] [bus name]
+	samplebus_publish /dev/ttyUSB0 9600 0 /adcap0
+	- reads the lines from stdin instead, e.g. from a recording or the simulator
+Sample lines are decoded once and go on the bus. Every other line (register dump, events,
+ping replies) goes on the bus as a text slot and is passed through to stdout.
+Lines written to the command FIFO (/tmp/<bus name>.cmd, see samplebus.h) are sent to the
+board; with - there is no board to send them to and they are dropped.
+*/
+#include "samplebus.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <termios.h>
+#include <poll.h>
+
+static speed_t baudConstant(long baud) {
+	switch (baud) {
+		case 9600: return B9600;
+		case 19200: return B19200;
+		case 38400: return B38400;
+		case 57600: return B57600;
+		case 115200: return B115200;
+		case 230400: return B230400;
+		case 500000: return B500000;
+		case 1000000: return B1000000;
+		default: return B0;
+	}
+}
+
+// raw 8N1, blocking reads, the commands are written to it
+static int openSerial(const char *path, long baud) {
+	int fd = open(path, O_RDWR | O_NOCTTY);
+	if (fd < 0)
+		return -1;
+	termios tio;
+	if (tcgetattr(fd, &tio) == 0) {		// a pseudo terminal or pipe may not take all of this
+		cfmakeraw(&tio);
+		tio.c_cflag |= CLOCAL | CREAD;
+		tio.c_cc[VMIN] = 1;
+		tio.c_cc[VTIME] = 0;
+		speed_t speed = baudConstant(baud);
+		if (speed != B0) {
+			cfsetispeed(&tio, speed);
+			cfsetospeed(&tio, speed);
+		}
+		tcsetattr(fd, TCSANOW, &tio);
+	}
+	return fd;
+}
+
+// cdc0<TAB>cdc1<TAB>cdc2[<TAB>board us], returns false for any other line
+static bool parseSample(const char *line, BusSample &s) {
+	char *end;
+	unsigned long v[4] = { 0, 0, 0, 0 };
+	int fields = 0;
+	const char *p = line;
+	while (fields < 4) {
+		if (*p < '0' || *p > '9')
+			break;
+		v[fields++] = strtoul(p, &end, 10);
+		p = end;
+		if (*p == '\t')
+			p++;
+		else
+			break;
+	}
+	if (fields < 3 || (*p != 0 && *p != '\r' && *p != '\n'))
+		return false;
+	s.cdc[0] = v[0];
+	s.cdc[1] = v[1];
+	s.cdc[2] = v[2];
+	s.boardUs = v[3];
+	return true;
+}
+
+int main(int argc, char **argv) {
+	if (argc < 2) {
+		fprintf(stderr, "usage: samplebus_publish <serial port or -> [baud] [board number] [bus name]\n");
+		return 2;
+	}
+	long baud = argc > 2 ? atol(argv[2]) : 9600;
+	uint8_t board = argc > 3 ? atoi(argv[3]) : 0;
+	const char *name = argc > 4 ? argv[4] : SAMPLEBUS_NAME;
+
+	int fd = strcmp(argv[1], "-") == 0 ? 0 : openSerial(argv[1], baud);
+	if (fd < 0) {
+		perror(argv[1]);
+		return 1;
+	}
+	BusWriter bus;
+	if (!bus.open(name)) {
+		perror(name);
+		return 1;
+	}
+	char fifoPath[128];
+	busCommandPath(name, fifoPath, sizeof(fifoPath));
+	unlink(fifoPath);
+	if (mkfifo(fifoPath, 0622) < 0) {
+		perror(fifoPath);
+		return 1;
+	}
+	chmod(fifoPath, 0622);		// whatever the umask, anyone may send commands
+	int commands = open(fifoPath, O_RDWR | O_NONBLOCK);		// also open for writing, so it never reads end of file
+	if (commands < 0) {
+		perror(fifoPath);
+		return 1;
+	}
+
+	char buffer[256];
+	char line[128];
+	size_t length = 0;
+	for (;;) {
+		pollfd fds[2] = { { fd, POLLIN, 0 }, { commands, POLLIN, 0 } };
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+		if (fds[1].revents & POLLIN) {
+			char command[PIPE_BUF];
+			ssize_t n = read(commands, command, sizeof(command));
+			if (n > 0 && fd != 0 && write(fd, command, n) != n)
+				perror("command");
+		}
+		if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+		ssize_t n = read(fd, buffer, sizeof(buffer));
+		if (n <= 0)
+			break;
+		uint64_t now = busNowNs();		// every line in this read arrived together
+		for (ssize_t i = 0; i < n; i++) {
+			char c = buffer[i];
+			if (c != '\n') {
+				if (length < sizeof(line) - 1)
+					line[length++] = c;
+				continue;
+			}
+			line[length] = 0;
+			length = 0;
+			BusSample s;
+			memset(&s, 0, sizeof(s));
+			s.hostNs = now;
+			s.board = board;
+			if (parseSample(line, s)) {
+				s.kind = BUS_SAMPLE;
+			}
+			else {
+				puts(line);
+				size_t end = strcspn(line, "\r");
+				if (end == 0)
+					continue;			// empty line
+				s.kind = BUS_LINE;
+				memcpy(s.text, line, end < SAMPLEBUS_TEXT - 1 ? end : SAMPLEBUS_TEXT - 1);
+			}
+			bus.publish(s);
+		}
+		fflush(stdout);
+	}
+	close(commands);
+	unlink(fifoPath);
+	return 0;
+}
@@ -0,0 +1,66 @@
+//////////////////////////////////////////////////////////////////////////
+///Example sample bus reader: prints every sample (see samplebus.h)
+
+/*
+usage: samplebus_tail [bus name] [-q]
+Prints board<TAB>cdc0<TAB>cdc1<TAB>cdc2<TAB>board us for every sample, read in place from
+the shared ring, and board<TAB>line for the other lines from the board. -q prints only a summary every second: samples, samples lost because
+this reader fell behind, and the time from the publisher reading the line to this reader
+getting it.
+*/
+#include "samplebus.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+int main(int argc, char **argv) {
+	const char *name = SAMPLEBUS_NAME;
+	bool quiet = false;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-q") == 0)
+			quiet = true;
+		else
+			name = argv[i];
+	}
+
+	BusReader bus;
+	while (!bus.open(name))
+		usleep(200000);			// no publisher yet
+
+	uint64_t count = 0;
+	uint64_t worstNs = 0;
+	uint64_t reportNs = busNowNs() + 1000000000ull;
+	for (;;) {
+		const BusSample *s = bus.peek();
+		if (!s) {
+			if (bus.restarted()) {
+				while (!bus.open(name))
+					usleep(200000);
+				continue;
+			}
+			bus.wait(100);
+		}
+		else {
+			uint64_t delay = busNowNs() - s->hostNs;
+			char text[SAMPLEBUS_TEXT + 8];
+			bool line = s->kind == BUS_LINE;
+			if (!quiet && line)
+				snprintf(text, sizeof(text), "%u\t%.*s\n", s->board, SAMPLEBUS_TEXT - 1, s->text);
+			else if (!quiet)
+				snprintf(text, sizeof(text), "%u\t%u\t%u\t%u\t%u\n", s->board, s->cdc[0], s->cdc[1], s->cdc[2], s->boardUs);
+			if (bus.done()) {		// only use what was read if the slot was not overwritten meanwhile
+				if (!line)
+					count++;
+				if (!line && delay > worstNs)
+					worstNs = delay;
+				if (!quiet)
+					fputs(text, stdout);
+			}
+		}
+		if (quiet && busNowNs() > reportNs) {
+			printf("samples %" PRIu64 "  lost %" PRIu64 "  worst bus delay %.1f us\n", count, bus.lostSamples(), worstNs / 1000.0);
+			fflush(stdout);
+			worstNs = 0;
+			reportNs += 1000000000ull;
+		}
+	}
+}
@@ -0,0 +1,86 @@
+//////////////////////////////////////////////////////////////////////////
+///Host stub of the Arduino core, enough to build test.cpp on the PC (see trace_replay.cpp)
+
+/*
+Time is virtual: micros() and millis() read a clock that only moves when the program
+using the stub moves it, _delay_ms() moves it by the delay and the idle sleep of the
+scheduler to the next ms. Serial output goes to stdout when stubEcho is set, Serial input
+is whatever was put in stubInput.
+*/
+#ifndef STUB_ARDUINO_H
+#define STUB_ARDUINO_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+extern uint64_t stubUs;				// the virtual clock
+void stubAdvance(uint64_t us);
+inline bool stubEcho;
+inline std::string stubInput;
+
+#define _delay_ms(ms) stubAdvance((uint64_t)((ms) * 1000))
+#define _delay_us(us) stubAdvance((uint64_t)(us))
+
+inline unsigned long micros() { return (unsigned long)stubUs; }
+inline unsigned long millis() { return (unsigned long)(stubUs / 1000); }
+inline void init() {}
+inline void attachInterrupt(uint8_t, void (*)(), int) {}
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(string_literal))
+#define PSTR(s) (s)
+
+#define DEC 10
+#define HEX 16
+#define RISING 3
+
+inline uint8_t SREG;
+#define cli()
+#define sei()
+extern uint8_t __heap_start;
+#define SP ((uintptr_t)&__heap_start)		// no free RAM to paint or measure on the PC
+
+class StubSerial {
+public:
+	void begin(unsigned long) {}
+	int available() { return stubInput.size(); }
+	int read() {
+		if (stubInput.empty())
+			return -1;
+		int c = (unsigned char)stubInput[0];
+		stubInput.erase(0, 1);
+		return c;
+	}
+	void write(uint8_t c) { if (stubEcho) putchar(c); }
+	void flush() {}
+
+	void print(const char *s) { while (*s) write(*s++); }
+	void print(const __FlashStringHelper *s) { print(reinterpret_cast<const char *>(s)); }
+	void print(char c) { write(c); }
+	void print(unsigned long n, int base = DEC) {
+		char text[24];
+		snprintf(text, sizeof(text), base == HEX ? "%lX" : "%lu", n);
+		print(text);
+	}
+	void print(long n, int base = DEC) {
+		if (n < 0 && base == DEC) {
+			write('-');
+			n = -n;
+		}
+		print((unsigned long)n, base);
+	}
+	void print(int n, int base = DEC) { print((long)n, base); }
+	void print(unsigned int n, int base = DEC) { print((unsigned long)n, base); }
+	void print(unsigned char n, int base = DEC) { print((unsigned long)n, base); }
+
+	template <typename T> void println(T value) { print(value); println(); }
+	template <typename T> void println(T value, int base) { print(value, base); println(); }
+	void println() { write('\r'); write('\n'); }
+};
+
+inline StubSerial Serial;
+
+#endif
@@ -0,0 +1,24 @@
+//////////////////////////////////////////////////////////////////////////
+///Host stub of the Arduino Wire library, the program using it defines the methods
+
+#ifndef STUB_WIRE_H
+#define STUB_WIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+class TwoWire {
+public:
+	void begin() {}
+	void setClock(uint32_t) {}
+	void beginTransmission(uint8_t address);
+	size_t write(uint8_t data);
+	uint8_t endTransmission(bool stop = true);
+	uint8_t requestFrom(int address, int quantity);
+	int available();
+	int read();
+};
+
+extern TwoWire Wire;
+
+#endif
@@ -0,0 +1,15 @@
+//////////////////////////////////////////////////////////////////////////
+///Host stub: flash and RAM are the same memory on the PC
+
+#ifndef STUB_PGMSPACE_H
+#define STUB_PGMSPACE_H
+
+#include <stdint.h>
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(const uint16_t *)(p))
+#define pgm_read_dword(p) (*(const uint32_t *)(p))
+#define pgm_read_ptr(p) (*(void * const *)(p))
+
+#endif
@@ -0,0 +1,15 @@
+//////////////////////////////////////////////////////////////////////////
+///Host stub: the idle sleep moves the virtual clock to the next ms (see Arduino.h)
+
+#ifndef STUB_SLEEP_H
+#define STUB_SLEEP_H
+
+#include <Arduino.h>
+
+#define SLEEP_MODE_IDLE 0
+#define set_sleep_mode(mode)
+#define sleep_enable()
+#define sleep_disable()
+#define sleep_cpu() stubAdvance(1000 - stubUs % 1000)
+
+#endif
@@ -0,0 +1,250 @@
+//////////////////////////////////////////////////////////////////////////
+///Runs the driver in test.cpp against an I2C trace and compares the transactions
+
+/*
+usage: trace_replay trace.txt [-L] [-R] [-v]
+test.cpp is built on the PC against the stubs in host/stub and runs from main(): the
+register setup, then the scheduler. Its Wire answers from the trace, every read gets the
+data and the Wire status the chip gave on the board and every write the status it got, and
+every transaction the driver makes is compared byte for byte with the trace entry at the
+same position:
+	write  S 58 reg_hi reg_lo data_hi data_lo P
+	read   S 58 reg_hi reg_lo Sr 59 R2
+(address byte with the R/W bit, Sr the repeated start, R2 two bytes read). It stops at the
+first difference.
+The startup part of the trace is compared from the first transaction. The ring starts
+wherever it was last overwritten, so its entries before the first sample marker are
+skipped and the driver's first sample is compared with the first whole sample in the ring.
+The clock follows the time stamps of the trace, so the hold and heartbeat times of event
+reporting fall where they did on the board; with -R the first heartbeat in the ring can
+still differ, the time of the last report before the ring is not in the trace.
+ -L  latency probe on (L1), -R event reporting on (R1), as they were when the trace was taken
+ -v  print what the driver sends on the serial port
+Exits 0 when every transaction of the trace matched, 1 at a difference or when the driver
+stops using the bus (10 s of board time without a transaction), 2 if the trace is not
+usable.
+
+Build (Linux): g++ -O2 -std=c++17 -I host/stub -o trace_replay host/trace_replay.cpp
+bin/raw/i2ctrace.rb replay runs it from host/trace_replay.
+*/
+#include <Arduino.h>
+#include <Wire.h>
+#include <setjmp.h>
+#include <vector>
+
+#define main driverMain
+#include "../test.cpp"
+#undef main
+
+#define IDLE_LIMIT_US 10000000ull		// no transaction for this long, the driver stopped
+
+struct TraceTransaction {
+	char op;
+	uint8_t device;
+	uint16_t address;
+	uint16_t data;
+	uint8_t status;
+	uint64_t us;					// unwrapped from the 16 bit time in 8 us steps
+	bool ring;						// from the ring, not the startup part
+};
+
+uint8_t __heap_start;
+uint64_t stubUs;
+TwoWire Wire;
+
+static std::vector<TraceTransaction> expected;
+static size_t position;					// next transaction of the trace
+static size_t startupLength;
+static size_t ringSamples;
+static int64_t clockOffsetUs;			// board time of the trace -> stub time, set at the start of each part
+static uint64_t lastTransactionUs;
+static jmp_buf finished;
+static int result;
+
+static std::string pending;				// the write of a read, until requestFrom
+static uint8_t rxBytes[2];
+static int rxLength;
+static int rxIndex;
+
+static void finish(int code) {
+	result = code;
+	longjmp(finished, 1);
+}
+
+void stubAdvance(uint64_t us) {
+	stubUs += us;
+	if (stubUs - lastTransactionUs > IDLE_LIMIT_US) {
+		printf("the driver made no transaction for %llu s after #%zu, the trace has %zu\n",
+			IDLE_LIMIT_US / 1000000, position, expected.size());
+		finish(1);
+	}
+}
+
+static std::string hexByte(uint8_t b) {
+	char text[4];
+	snprintf(text, sizeof(text), "%02X", b);
+	return text;
+}
+
+static std::string expectedBytes(const TraceTransaction &t) {
+	std::string s = "S " + hexByte(t.device << 1) + " " + hexByte(t.address >> 8) + " " + hexByte(t.address & 0xFF);
+	if (t.op == 'W')
+		return s + " " + hexByte(t.data >> 8) + " " + hexByte(t.data & 0xFF) + " P";
+	return s + " Sr " + hexByte((t.device << 1) | 1) + " R2";
+}
+
+// the next transaction of the trace, or the end of the run if there is none
+static const TraceTransaction &next() {
+	if (position == expected.size()) {
+		printf("identical: %zu transactions, %zu at startup and %zu in %zu samples\n",
+			expected.size(), startupLength, expected.size() - startupLength, ringSamples);
+		finish(0);
+	}
+	const TraceTransaction &t = expected[position];
+	if (position == 0 || position == startupLength)
+		clockOffsetUs = (int64_t)stubUs - (int64_t)t.us;
+	uint64_t boardUs = t.us + clockOffsetUs;
+	if (boardUs > stubUs)
+		stubUs = boardUs;
+	lastTransactionUs = stubUs;
+	return t;
+}
+
+static void compare(const TraceTransaction &t, const std::string &driver) {
+	std::string trace = expectedBytes(t);
+	if (driver != trace) {
+		printf("#%zu (%s): trace %s, driver %s\n", position, t.ring ? "sample" : "startup", trace.c_str(), driver.c_str());
+		finish(1);
+	}
+	position++;
+}
+
+void TwoWire::beginTransmission(uint8_t address) {
+	pending = "S " + hexByte(address << 1);
+}
+
+size_t TwoWire::write(uint8_t data) {
+	pending += " " + hexByte(data);
+	return 1;
+}
+
+// with stop a register write, without it the first half of a read
+uint8_t TwoWire::endTransmission(bool stop) {
+	const TraceTransaction &t = next();
+	if (!stop)
+		return t.status & 0x7F;
+	compare(t, pending + " P");
+	return t.status & 0x7F;
+}
+
+uint8_t TwoWire::requestFrom(int address, int quantity) {
+	const TraceTransaction &t = next();
+	char read[8];
+	snprintf(read, sizeof(read), " R%d", quantity);
+	compare(t, pending + " Sr " + hexByte((address << 1) | 1) + read);
+	rxIndex = 0;
+	rxLength = 0;
+	if (!(t.status & TRACE_NO_DATA)) {
+		rxBytes[0] = t.data >> 8;
+		rxBytes[1] = t.data & 0xFF;
+		rxLength = 2;
+	}
+	return rxLength;
+}
+
+int TwoWire::available() {
+	return rxLength - rxIndex;
+}
+
+int TwoWire::read() {
+	return rxIndex < rxLength ? rxBytes[rxIndex++] : -1;
+}
+
+// the last dump in the file, like I2cTrace.load in bin/raw/i2ctrace.rb
+static bool loadTrace(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		printf("cannot open %s\n", path);
+		return false;
+	}
+	std::vector<TraceTransaction> entries;
+	long startupCount = -1;
+	char line[128];
+	unsigned lastTime = 0;
+	bool first = true;
+	uint64_t us = 0;
+	while (fgets(line, sizeof(line), f)) {
+		unsigned long total, count;
+		long startup;
+		char op;
+		unsigned device, address, data, status, time;
+		if (line[0] == 'T' && strncmp(line, "T\tend", 5) != 0) {
+			startup = -1;
+			if (sscanf(line, "T\t%lu\t%lu\t%ld", &total, &count, &startup) >= 2) {
+				entries.clear();
+				startupCount = startup;
+				first = true;
+				us = 0;
+			}
+		}
+		else if (sscanf(line, "I\t%c\t%x\t%x\t%x\t%x\t%x", &op, &device, &address, &data, &status, &time) == 6) {
+			if (!first)
+				us += ((time - lastTime) & 0xFFFF) * 8;
+			first = false;
+			lastTime = time;
+			entries.push_back({ op, (uint8_t)device, (uint16_t)address, (uint16_t)data, (uint8_t)status, us, false });
+		}
+	}
+	fclose(f);
+	if (entries.empty()) {
+		printf("no trace in %s\n", path);
+		return false;
+	}
+	if (startupCount < 0) {
+		printf("the trace has no startup count, take it with the current firmware\n");
+		return false;
+	}
+	if (startupCount > TRACE_STARTUP) {
+		printf("the startup part is incomplete (%ld transactions, %d kept), raise TRACE_STARTUP\n", startupCount, TRACE_STARTUP);
+		return false;
+	}
+	startupLength = startupCount;
+	expected.assign(entries.begin(), entries.begin() + startupLength);
+	bool inSample = false;
+	for (size_t i = startupLength; i < entries.size(); i++) {
+		TraceTransaction t = entries[i];
+		if (t.op == TRACE_MARK) {
+			inSample = true;
+			ringSamples++;
+			continue;
+		}
+		if (!inSample)		// the rest of a sample that was partly overwritten
+			continue;
+		t.ring = true;
+		expected.push_back(t);
+	}
+	return true;
+}
+
+int main(int argc, char **argv) {
+	const char *path = NULL;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "-L") == 0)
+			latencyProbe = 1;
+		else if (strcmp(argv[i], "-R") == 0)
+			eventReporting = 1;
+		else if (strcmp(argv[i], "-v") == 0)
+			stubEcho = true;
+		else
+			path = argv[i];
+	}
+	if (!path) {
+		printf("usage: trace_replay trace.txt [-L] [-R] [-v]\n");
+		return 2;
+	}
+	if (!loadTrace(path))
+		return 2;
+	if (!setjmp(finished))
+		driverMain();		// never returns, finish() ends the run
+	return result;
+}
@@ -0,0 +1,102 @@
+//////////////////////////////////////////////////////////////////////////
+///Lean layer: the few Arduino calls test.cpp uses, straight on the registers
+
+/*
+The [Lean] profile in bin/settings.ini links this instead of the Arduino core and Wire:
+	ruby bin/raw/build.rb build lean		builds src/lean into liblean.a
+	ruby bin/raw/build.rb compile lean	test.cpp with LEAN_BUILD=1 against it
+The names are the Arduino ones, so test.cpp is the same source in both builds.
+Not yet compiled with avr-gcc: the RAM it saves is unmeasured until a real build has put
+both profiles in output/codes/memory.log, and it is not for boards before that.
+
+ - timer 0 in CTC mode interrupts every 1 ms exactly (Arduino: overflow every 1024 us at
+   16 MHz, 2048 us at 8 MHz). micros() adds the counter, 8 us steps at 8 MHz
+ - Serial is USART0, 8N1 at double speed, interrupt driven with a LEAN_TX_BUFFER byte
+   transmit ring (Arduino: 64), so a burst of sample lines is queued instead of waiting
+   for the baud rate. The register dump at boot (about 500 bytes) still fills it and
+   waits, and boot time is set by the _delay_ms(1) of each startup register access
+ - Wire is a polled TWI master, no interrupt and no buffers beyond the 4 byte register
+   write and the 2 byte read test.cpp does (Arduino Wire keeps five 32 byte buffers).
+   Every wait for the hardware gives up after LEAN_TWI_TIMEOUT polls, so a missing chip
+   returns an error instead of hanging
+ - attachInterrupt() for INT0-INT2, the sync pulse input
+Nothing else (no PWM timers, no ADC, no String, no malloc) is set up or linked.
+*/
+#ifndef LEAN_H
+#define LEAN_H
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/delay.h>
+#include <stdlib.h>
+#include <inttypes.h>
+
+#define LEAN_TX_BUFFER 256		// power of two, at most 256
+#define LEAN_RX_BUFFER 32			// power of two, at most 256
+#define LEAN_TWI_BUFFER 8
+#define LEAN_TWI_FREQ 100000UL
+#define LEAN_TWI_TIMEOUT 10000	// polls of TWINT, about 20 ms at 8 MHz
+
+#define DEC 10
+#define HEX 16
+
+#define LOW 0
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper *>(PSTR(string_literal)))
+
+void init();
+unsigned long millis();
+unsigned long micros();
+void attachInterrupt(uint8_t interruptNum, void (*handler)(), int mode);
+
+class LeanSerial {
+public:
+	void begin(unsigned long baud);
+	int available();
+	int read();
+	void write(uint8_t c);
+	void flush();			// waits until the last byte has left the UART
+
+	void print(const char *s);
+	void print(const __FlashStringHelper *s);
+	void print(char c) { write(c); }
+	void print(unsigned char n, int base = DEC) { print((unsigned long)n, base); }
+	void print(int n, int base = DEC) { print((long)n, base); }
+	void print(unsigned int n, int base = DEC) { print((unsigned long)n, base); }
+	void print(long n, int base = DEC);
+	void print(unsigned long n, int base = DEC);
+
+	template <typename T> void println(T value) { print(value); println(); }
+	template <typename T> void println(T value, int base) { print(value, base); println(); }
+	void println() { write('\r'); write('\n'); }
+};
+
+class LeanWire {
+public:
+	void begin();
+	void setClock(unsigned long frequency);
+	void beginTransmission(uint8_t address);
+	void write(uint8_t data);
+	uint8_t endTransmission(bool stop = true);	// 0 ok, 2 address NACK, 3 data NACK, 4 bus error, 5 timeout
+	uint8_t requestFrom(uint8_t address, uint8_t quantity);
+	int available();
+	int read();
+
+private:
+	uint8_t address;
+	uint8_t txBuffer[LEAN_TWI_BUFFER];
+	uint8_t txLength;
+	uint8_t rxBuffer[LEAN_TWI_BUFFER];
+	uint8_t rxLength;
+	uint8_t rxIndex;
+};
+
+extern LeanSerial Serial;
+extern LeanWire Wire;
+
+#endif
@@ -0,0 +1,70 @@
+//////////////////////////////////////////////////////////////////////////
+///Lean layer: timer 0 time base and the external interrupts (see lean.h)
+
+#include "lean.h"
+
+#define TIMER_PRESCALER 64
+#define TICKS_PER_MS (F_CPU / TIMER_PRESCALER / 1000)		// 125 at 8 MHz, 250 at 16 MHz
+#define US_PER_TICK (TIMER_PRESCALER * 1000000UL / F_CPU)	// 8 at 8 MHz, 4 at 16 MHz
+
+volatile unsigned long timerMs;
+
+ISR(TIMER0_COMPA_vect) {
+	timerMs++;
+}
+
+void init() {
+	TCCR0A = _BV(WGM01);								// CTC, counts 0..OCR0A
+	TCCR0B = _BV(CS01) | _BV(CS00);			// clk/64
+	OCR0A = TICKS_PER_MS - 1;
+	TIMSK0 = _BV(OCIE0A);
+	sei();
+}
+
+unsigned long millis() {
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned long ms = timerMs;
+	SREG = oldSREG;
+	return ms;
+}
+
+unsigned long micros() {
+	uint8_t oldSREG = SREG;
+	cli();
+	unsigned long ms = timerMs;
+	uint8_t ticks = TCNT0;
+	if ((TIFR0 & _BV(OCF0A)) && ticks < TICKS_PER_MS - 1)		// wrapped after cli(), the interrupt is still pending
+		ms++;
+	SREG = oldSREG;
+	return ms * 1000 + ticks * US_PER_TICK;
+}
+
+static void (*externalHandler[3])();
+
+void attachInterrupt(uint8_t interruptNum, void (*handler)(), int mode) {
+	if (interruptNum > 2)
+		return;
+	externalHandler[interruptNum] = handler;
+	uint8_t shift = 2 * interruptNum;		// ISCn1:ISCn0 in EICRA, same encoding as the mode
+	EICRA = (EICRA & ~(3 << shift)) | ((mode & 3) << shift);
+	EIFR = _BV(interruptNum);
+	EIMSK |= _BV(interruptNum);
+}
+
+ISR(INT0_vect) {
+	if (externalHandler[0])
+		externalHandler[0]();
+}
+
+ISR(INT1_vect) {
+	if (externalHandler[1])
+		externalHandler[1]();
+}
+
+#ifdef INT2_vect
+ISR(INT2_vect) {
+	if (externalHandler[2])
+		externalHandler[2]();
+}
+#endif
@@ -0,0 +1,113 @@
+//////////////////////////////////////////////////////////////////////////
+///Lean layer: polled TWI (I2C) master (see lean.h)
+
+#include "lean.h"
+#include <util/twi.h>
+
+LeanWire Wire;
+
+// TW_STATUS has the prescaler bits masked off, so this is never a real status
+// (0x00 is one: TW_BUS_ERROR)
+#define TWI_TIMEOUT 0xFF
+
+// waits for the current bus step, returns the status or TWI_TIMEOUT
+static uint8_t twiWait() {
+	uint16_t polls = LEAN_TWI_TIMEOUT;
+	while (!(TWCR & _BV(TWINT))) {
+		if (--polls == 0) {
+			TWCR = 0;				// release the bus and start the hardware over
+			TWCR = _BV(TWEN);
+			return TWI_TIMEOUT;
+		}
+	}
+	return TW_STATUS;
+}
+
+// start or repeated start, then the address; returns the status after the address
+static uint8_t twiAddress(uint8_t sla) {
+	TWCR = _BV(TWINT) | _BV(TWSTA) | _BV(TWEN);
+	uint8_t status = twiWait();
+	if (status != TW_START && status != TW_REP_START)
+		return status;
+	TWDR = sla;
+	TWCR = _BV(TWINT) | _BV(TWEN);
+	return twiWait();
+}
+
+static void twiStop() {
+	TWCR = _BV(TWINT) | _BV(TWSTO) | _BV(TWEN);
+	uint16_t polls = LEAN_TWI_TIMEOUT;
+	while ((TWCR & _BV(TWSTO)) && --polls)
+		;
+}
+
+void LeanWire::begin() {
+	setClock(LEAN_TWI_FREQ);
+	TWCR = _BV(TWEN);
+}
+
+void LeanWire::setClock(unsigned long frequency) {
+	TWSR = 0;		// prescaler 1
+	TWBR = (F_CPU / frequency - 16) / 2;
+}
+
+void LeanWire::beginTransmission(uint8_t sla) {
+	address = sla;
+	txLength = 0;
+}
+
+void LeanWire::write(uint8_t data) {
+	if (txLength < LEAN_TWI_BUFFER)
+		txBuffer[txLength++] = data;
+}
+
+uint8_t LeanWire::endTransmission(bool stop) {
+	uint8_t status = twiAddress(TW_WRITE | (address << 1));
+	uint8_t result = 0;
+	if (status != TW_MT_SLA_ACK) {
+		result = status == TW_MT_SLA_NACK ? 2 : (status == TWI_TIMEOUT ? 5 : 4);
+	}
+	else {
+		for (uint8_t i = 0; i < txLength; i++) {
+			TWDR = txBuffer[i];
+			TWCR = _BV(TWINT) | _BV(TWEN);
+			status = twiWait();
+			if (status != TW_MT_DATA_ACK) {
+				result = status == TW_MT_DATA_NACK ? 3 : (status == TWI_TIMEOUT ? 5 : 4);
+				break;
+			}
+		}
+	}
+	if (stop || result)		// without stop the next requestFrom() sends a repeated start
+		twiStop();
+	return result;
+}
+
+uint8_t LeanWire::requestFrom(uint8_t sla, uint8_t quantity) {
+	rxLength = 0;
+	rxIndex = 0;
+	if (quantity > LEAN_TWI_BUFFER)
+		quantity = LEAN_TWI_BUFFER;
+	if (twiAddress(TW_READ | (sla << 1)) == TW_MR_SLA_ACK) {
+		while (rxLength < quantity) {
+			bool last = rxLength == quantity - 1;
+			TWCR = _BV(TWINT) | _BV(TWEN) | (last ? 0 : _BV(TWEA));		// NACK the last byte
+			uint8_t status = twiWait();
+			if (status != TW_MR_DATA_ACK && status != TW_MR_DATA_NACK)
+				break;
+			rxBuffer[rxLength++] = TWDR;
+		}
+	}
+	twiStop();
+	return rxLength;
+}
+
+int LeanWire::available() {
+	return rxLength - rxIndex;
+}
+
+int LeanWire::read() {
+	if (rxIndex >= rxLength)
+		return -1;
+	return rxBuffer[rxIndex++];
+}
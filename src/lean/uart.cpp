@@ -0,0 +1,121 @@
+//////////////////////////////////////////////////////////////////////////
+///Lean layer: USART0 with interrupt driven receive and transmit rings (see lean.h)
+
+#include "lean.h"
+
+#define TX_MASK (LEAN_TX_BUFFER - 1)
+#define RX_MASK (LEAN_RX_BUFFER - 1)
+
+LeanSerial Serial;
+
+// head is only written by the producer and tail by the consumer, one slot stays empty
+static volatile uint8_t txBuffer[LEAN_TX_BUFFER];
+static volatile uint8_t txHead;
+static volatile uint8_t txTail;
+static volatile uint8_t rxBuffer[LEAN_RX_BUFFER];
+static volatile uint8_t rxHead;
+static volatile uint8_t rxTail;
+static uint8_t written;			// flush() has nothing to wait for before the first byte
+
+// moves the next byte into the UART, from the interrupt or polled with interrupts off
+static void txNext() {
+	uint8_t tail = txTail;
+	UDR0 = txBuffer[tail];
+	tail = (tail + 1) & TX_MASK;
+	txTail = tail;
+	if (tail == txHead)
+		UCSR0B &= ~_BV(UDRIE0);
+}
+
+ISR(USART0_RX_vect) {
+	uint8_t c = UDR0;
+	uint8_t next = (rxHead + 1) & RX_MASK;
+	if (next != rxTail) {		// else dropped, like the Arduino core
+		rxBuffer[rxHead] = c;
+		rxHead = next;
+	}
+}
+
+ISR(USART0_UDRE_vect) {
+	txNext();
+}
+
+void LeanSerial::begin(unsigned long baud) {
+	UBRR0 = (F_CPU / 4 / baud - 1) / 2;		// double speed, rounded
+	UCSR0A = _BV(U2X0);
+	UCSR0C = _BV(UCSZ01) | _BV(UCSZ00);		// 8N1
+	UCSR0B = _BV(RXEN0) | _BV(TXEN0) | _BV(RXCIE0);
+}
+
+int LeanSerial::available() {
+	return (rxHead - rxTail) & RX_MASK;
+}
+
+int LeanSerial::read() {
+	uint8_t tail = rxTail;
+	if (rxHead == tail)
+		return -1;
+	uint8_t c = rxBuffer[tail];
+	rxTail = (tail + 1) & RX_MASK;
+	return c;
+}
+
+void LeanSerial::write(uint8_t c) {
+	uint8_t head = txHead;
+	uint8_t next = (head + 1) & TX_MASK;
+	while (next == txTail) {		// full, wait for the interrupt to make room
+		if (!(SREG & _BV(SREG_I)) && (UCSR0A & _BV(UDRE0)))
+			txNext();
+	}
+	txBuffer[head] = c;
+	uint8_t oldSREG = SREG;
+	cli();
+	txHead = next;
+	UCSR0A = (UCSR0A & _BV(U2X0)) | _BV(TXC0);		// writing 1 clears the done flag for flush()
+	UCSR0B |= _BV(UDRIE0);
+	SREG = oldSREG;
+	written = 1;
+}
+
+void LeanSerial::flush() {
+	if (!written)
+		return;
+	while ((UCSR0B & _BV(UDRIE0)) || !(UCSR0A & _BV(TXC0))) {
+		if (!(SREG & _BV(SREG_I)) && (UCSR0A & _BV(UDRE0)) && (UCSR0B & _BV(UDRIE0)))
+			txNext();
+	}
+}
+
+void LeanSerial::print(const char *s) {
+	while (*s)
+		write(*s++);
+}
+
+void LeanSerial::print(const __FlashStringHelper *s) {
+	const char *p = reinterpret_cast<const char *>(s);
+	char c;
+	while ((c = pgm_read_byte(p++)))
+		write(c);
+}
+
+void LeanSerial::print(long n, int base) {
+	if (n < 0 && base == DEC) {
+		write('-');
+		n = -n;
+	}
+	print((unsigned long)n, base);
+}
+
+void LeanSerial::print(unsigned long n, int base) {
+	char digits[33];		// base 2 needs 32
+	char *p = digits + sizeof(digits) - 1;
+	*p = 0;
+	if (base < 2)
+		base = DEC;
+	do {
+		uint8_t d = n % base;
+		n /= base;
+		*--p = d < 10 ? '0' + d : 'A' + d - 10;
+	} while (n);
+	print(p);
+}
@@ -2,11 +2,19 @@
 ///AD7147 Driver by Md Shafiqur Rahman & Jacob Girgis
 
 //Header files
+#ifndef LEAN_BUILD
+#define LEAN_BUILD 0			// 1 from the [Lean] profile in bin/settings.ini (bin/raw/build.rb compile lean)
+#endif
+#if LEAN_BUILD
+#include "lean.h"					// only UART, TWI and timer 0 instead of the Arduino core and Wire, see src/lean/lean.h
+#else
 #include <Arduino.h>			// Use the arduino functions (digitalWrite/Read, analogRead, tone, Serial, .etc)
 #include <Wire.h>					// used for I2C communication
+#endif
 #include "avr/pgmspace.h" // allows for better memory allocation
 #include <stdlib.h>				// standard library
 #include <inttypes.h> 		// recognize uint8_t, uint16_t and other types
+#include <avr/sleep.h>		// idle sleep between tasks
 
 //REGISTERS and ADDRESSES
 #define AD7147_ADDR 0x2C  
@@ -51,6 +59,27 @@
 #define CDC_RESULT_S0 0x00B
 #define CDC_RESULT_S1 0x00C
 #define CDC_RESULT_S2 0x00D
+#define STAGE0_SENSITIVITY 0x083
+#define STAGE0_OFFSET_LOW 0x084
+#define STAGE0_OFFSET_HIGH 0x085
+#define STAGE0_OFFSET_HIGH_CLAMP 0x086
+#define STAGE0_OFFSET_LOW_CLAMP 0x087
+#define STAGE1_SENSITIVITY 0x08B
+#define STAGE1_OFFSET_LOW 0x08C
+#define STAGE1_OFFSET_HIGH 0x08D
+#define STAGE1_OFFSET_HIGH_CLAMP 0x08E
+#define STAGE1_OFFSET_LOW_CLAMP 0x08F
+#define STAGE2_SENSITIVITY 0x093
+#define STAGE2_OFFSET_LOW 0x094
+#define STAGE2_OFFSET_HIGH 0x095
+#define STAGE2_OFFSET_HIGH_CLAMP 0x096
+#define STAGE2_OFFSET_LOW_CLAMP 0x097
+#define STAGE0_HIGH_THRESHOLD 0x0FA
+#define STAGE0_LOW_THRESHOLD 0x101
+#define STAGE1_HIGH_THRESHOLD 0x11E
+#define STAGE1_LOW_THRESHOLD 0x125
+#define STAGE2_HIGH_THRESHOLD 0x142
+#define STAGE2_LOW_THRESHOLD 0x149
 
 
 
@@ -105,6 +134,116 @@ Process to read a register from AD7147
 
 */
 
+/*
+I2C trace
+With I2C_TRACE set to 1 every register read and write is kept in a small ring in RAM,
+8 bytes each: what it was (read, write or the start of a sample), device address,
+register, data, the Wire status and the time in 8 us steps (wraps every 524 ms, the host
+unwraps it). The host sends T and gets the trace back:
+
+T<tab>transactions since reset<tab>entries that follow<tab>transactions before the first sample
+I<tab>op<tab>addr<tab>register<tab>data<tab>status<tab>time		(one per entry, hex)
+T<tab>end
+
+Everything before the first sample marker (the register setup) goes into its own part of
+TRACE_STARTUP entries that is never overwritten, so the setup can still be compared with
+a known good trace long after start. After the first marker the entries go into a ring of
+the newest TRACE_LENGTH entries, markers included. The dump is the startup part, then the
+ring oldest first.
+bin/raw/i2ctrace.rb decodes it, compares it against an older trace and keeps the bus
+traffic numbers.
+*/
+#define I2C_TRACE 0
+#define TRACE_STARTUP 80			// entries kept from before the first sample, 8 bytes of RAM each
+#if LEAN_BUILD
+#define TRACE_LENGTH 128			// entries in the ring, 8 bytes of RAM each, at most 128
+#else
+#define TRACE_LENGTH 64
+#endif
+
+#define TRACE_WRITE 'W'
+#define TRACE_READ 'R'
+#define TRACE_MARK 'M'				// start of a sample in the main loop
+#define TRACE_NO_DATA 0x80		// status bit: the read got no bytes back
+
+#if I2C_TRACE
+struct TraceEntry {
+	uint8_t op;
+	uint8_t status;
+	uint16_t address;
+	uint16_t data;
+	uint16_t time;
+};
+
+TraceEntry traceStartup[TRACE_STARTUP];
+TraceEntry trace[TRACE_LENGTH];
+uint8_t traceStartupUsed;		// entries in traceStartup
+uint16_t startupCount;			// transactions before the first marker, also the ones that did not fit
+uint8_t traceStarted;				// the first marker was written
+uint8_t traceHead;					// next ring entry to write
+uint32_t traceWritten;			// ring entries written, markers included
+uint32_t traceCount;				// transactions since reset, also counts the ones that fell out of the ring
+
+void traceRecord(uint8_t op, uint16_t address, uint16_t data, uint8_t status) {
+	TraceEntry *e;
+	if (op == TRACE_MARK)
+		traceStarted = 1;
+	else
+		traceCount++;
+	if (!traceStarted) {
+		startupCount++;
+		if (traceStartupUsed == TRACE_STARTUP)		// setup longer than TRACE_STARTUP, the host sees it is incomplete
+			return;
+		e = &traceStartup[traceStartupUsed++];
+	}
+	else {
+		e = &trace[traceHead];
+		traceHead = (traceHead + 1) % TRACE_LENGTH;
+		traceWritten++;
+	}
+	e->op = op;
+	e->status = status;
+	e->address = address;
+	e->data = data;
+	e->time = micros() >> 3;
+}
+
+void tracePrint(TraceEntry *e) {
+	Serial.print(F("I\t"));
+	Serial.write(e->op);
+	Serial.write('\t');
+	Serial.print(AD7147_ADDR, HEX);
+	Serial.write('\t');
+	Serial.print(e->address, HEX);
+	Serial.write('\t');
+	Serial.print(e->data, HEX);
+	Serial.write('\t');
+	Serial.print(e->status, HEX);
+	Serial.write('\t');
+	Serial.print(e->time, HEX);
+	Serial.write('\n');
+}
+
+// startup part, then the ring oldest first
+void traceDump() {
+	uint8_t ringEntries = traceWritten < TRACE_LENGTH ? traceWritten : TRACE_LENGTH;
+	uint8_t start = (traceHead + TRACE_LENGTH - ringEntries) % TRACE_LENGTH;
+	Serial.print(F("T\t"));
+	Serial.print(traceCount);
+	Serial.write('\t');
+	Serial.print((uint16_t)traceStartupUsed + ringEntries);
+	Serial.write('\t');
+	Serial.println(startupCount);
+	for (uint8_t i = 0; i < traceStartupUsed; i++)
+		tracePrint(&traceStartup[i]);
+	for (uint8_t i = 0; i < ringEntries; i++)
+		tracePrint(&trace[(start + i) % TRACE_LENGTH]);
+	Serial.println(F("T\tend"));
+}
+#else
+#define traceRecord(op, address, data, status)
+#endif
+
 // this function reads from a register and returns the 16 bit register value
 uint16_t readByte(uint16_t address) {  
 
@@ -166,9 +305,11 @@ uint16_t readByte(uint16_t address) {
      when there is a 0 it only gets copied over when both bits are 0's
     */
     rxFinal16bitbyte = (rx1Byte << 8) | rx2Byte; //combined of the two 8 bits to a 16 bit
+    traceRecord(TRACE_READ, address, rxFinal16bitbyte, i2cStatus);
     return rxFinal16bitbyte; // return final number 
   }
   else {
+    traceRecord(TRACE_READ, address, 0xFFFF, i2cStatus | TRACE_NO_DATA);
     // return an error code
     return -1;
   }
@@ -183,6 +324,7 @@ bool writeByte(uint16_t address, uint16_t data16bit) { // register address and d
   Wire.write((data16bit) & 0xFF);				// write the data value lower byte
   int i2cStatus = Wire.endTransmission();	// write all the commands in the queue and close the connection
   _delay_ms(1);	// let it do its thing, in case it takes a long time
+  traceRecord(TRACE_WRITE, address, data16bit, i2cStatus);
   if (i2cStatus)		// return false if i2cStatus is 1, indicating an error
     return false;
   else
@@ -191,212 +333,901 @@ bool writeByte(uint16_t address, uint16_t data16bit) { // register address and d
 
 
 
-void writeStage0_Connection60(){
+/*
+Stage setup
+The CIN connections and AFE offsets of the 12 stages are written once at start from this
+table. It is in flash (PROGMEM) and read with pgm_read_word: on the AVR everything else
+that is const, string literals too, is copied into RAM at reset.
+*/
+struct RegisterValue {
+	uint16_t address;
+	uint16_t value;
+};
+
+const RegisterValue stageSetup[] PROGMEM = {
+	{ STAGE0_CONNECTION60, 0b0011111111111110 },		//CIN0 Connected to CDC Positive input, CIN1 and CIN2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE0_CONNECTION127, 0b0001111111111111 },
+	{ STAGE0_AFE_OFFSET, 0b1000010010010111 },
+	{ STAGE1_CONNECTION60, 0b0011111111111011 },		//CIN1 Connected to CDC Positive input, CIN0 and CIN2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE1_CONNECTION127, 0b0001111111111111 },
+	{ STAGE1_AFE_OFFSET, 0b1000001010010001 },
+	{ STAGE2_CONNECTION60, 0b0011111111101111 },		//CIN2 Connected to CDC Positive input, CIN0 and CIN2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE2_CONNECTION127, 0b0001111111111111 },
+	{ STAGE2_AFE_OFFSET, 0b1000001110010100 },
+	{ STAGE3_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE3_CONNECTION127, 0b1100111111111111 },
+	{ STAGE4_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE4_CONNECTION127, 0b1100111111111111 },
+	{ STAGE5_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE5_CONNECTION127, 0b1100111111111111 },
+	{ STAGE6_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE6_CONNECTION127, 0b1100111111111111 },
+	{ STAGE7_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE7_CONNECTION127, 0b1100111111111111 },
+	{ STAGE8_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE8_CONNECTION127, 0b1100111111111111 },
+	{ STAGE9_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE9_CONNECTION127, 0b1100111111111111 },
+	{ STAGE10_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE10_CONNECTION127, 0b1100111111111111 },
+	{ STAGE11_CONNECTION60, 0b0011111111111111 },		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	{ STAGE11_CONNECTION127, 0b1100111111111111 },
+};
+
+void writeStageSetup(){
 	
-	writeByte(STAGE0_CONNECTION60,0b0011111111111110);		//CIN0 Connected to CDC Positive input, CIN1 and CIN2 not connected to CDC inputs, all other CINx are connected to BIAS
+	for (uint8_t i = 0; i < sizeof(stageSetup) / sizeof(stageSetup[0]); i++)
+		writeByte(pgm_read_word(&stageSetup[i].address), pgm_read_word(&stageSetup[i].value));
 }
 
-void writeStage0_Connection127(){
+// registers printed at start, in decimal form, so convert it later
+struct RegisterName {
+	uint16_t address;
+	char name[24];
+};
+
+const RegisterName registerDump[] PROGMEM = {
+	{ PWR_CONTROL, "PWR_CONTROL" },
+	{ STAGE_CAL_EN, "STAGE_CAL_EN" },
+	{ STAGE0_CONNECTION60, "Stage0_Connection[6:0]" },
+	{ STAGE0_CONNECTION127, "Stage0_Connection[12:7]" },
+	{ STAGE1_CONNECTION60, "Stage1_Connection[6:0]" },
+	{ STAGE1_CONNECTION127, "Stage1_Connection[12:7]" },
+	{ STAGE2_CONNECTION60, "Stage2_Connection[6:0]" },
+	{ STAGE2_CONNECTION127, "Stage2_Connection[12:7]" },
+	{ STAGE0_AFE_OFFSET, "Stage0_Afe_Offset" },
+	{ STAGE1_AFE_OFFSET, "Stage1_Afe_Offset" },
+	{ STAGE2_AFE_OFFSET, "Stage2_Afe_Offset" },
+	{ STAGE0_HIGH_THRESHOLD, "Stage0_High_Threshold" },
+	{ STAGE0_LOW_THRESHOLD, "Stage0_Low_Threshold" },
+	{ STAGE1_HIGH_THRESHOLD, "Stage1_High_Threshold" },
+	{ STAGE1_LOW_THRESHOLD, "Stage1_Low_Threshold" },
+	{ STAGE2_HIGH_THRESHOLD, "Stage2_High_Threshold" },
+	{ STAGE2_LOW_THRESHOLD, "Stage2_Low_Threshold" },
+};
+
+void printRegisters(){
 	
-	writeByte(STAGE0_CONNECTION127,0b0001111111111111);		
+	for (uint8_t i = 0; i < sizeof(registerDump) / sizeof(registerDump[0]); i++) {
+		Serial.print((const __FlashStringHelper *)registerDump[i].name);
+		Serial.write('\t');
+		Serial.println(readByte(pgm_read_word(&registerDump[i].address)));
+	}
 }
 
-void writeStage1_Connection60(){
+/*
+PWR_CONTROL settings
+The PWR_CONTROL value is built from these fields instead of one fixed number:
+15-14 CDC_BIAS             left at 00 (normal)
+11    INT_POL              1 = INT pin active high
+9-8   DECIMATION           00 = 256, 01 = 128, 10 = 64
+7-4   SEQUENCE_STAGE_NUM   number of stages in the sequence - 1
+3-2   LP_CONV_DELAY        00 = 200 ms, 01 = 400 ms, 10 = 600 ms, 11 = 800 ms between sequences
+1-0   POWER_MODE           00 = full power, 01 = shutdown, 10 = low power
+The defaults below give the old fixed value 0b0000101000100000 (decimate by 64, 3 stages,
+full power).
+
+Each stage conversion takes 0.768 ms at decimation 256, 0.384 ms at 128 and 0.192 ms at 64
+(full power conversion time table of the datasheet, 9.216 ms for 12 stages at 256), and the
+whole sequence is done before any result updates again. A lower decimation is faster but
+averages less, so it is noisier. bin/raw/characterize.rb measures that trade.
+The host can change the settings while running with
+C<decimation>,<stages>,<power mode>,<delay>   e.g. C2,3,0,0
+and gets back C<tab>PWR_CONTROL value<tab>sequence time in us. C alone just reports.
+*/
+#define DECIMATE_256 0
+#define DECIMATE_128 1
+#define DECIMATE_64 2
+
+#define FULL_POWER 0
+#define FULL_SHUTDOWN 1
+#define LOW_POWER 2
+
+#define LP_DELAY_200MS 0
+#define LP_DELAY_400MS 1
+#define LP_DELAY_600MS 2
+#define LP_DELAY_800MS 3
+
+struct PwrSettings {
+	uint8_t decimation;
+	uint8_t stages;			// 1 to 12
+	uint8_t powerMode;
+	uint8_t lpDelay;		// only used in low power mode
+};
+
+PwrSettings pwr = { DECIMATE_64, 3, FULL_POWER, LP_DELAY_200MS };
+
+uint16_t pwrControlValue(const PwrSettings *p){
 	
-	writeByte(STAGE1_CONNECTION60,0b0011111111111011);		//CIN1 Connected to CDC Positive input, CIN0 and CIN2 not connected to CDC inputs, all other CINx are connected to BIAS
+	return (1 << 11)											// INT_POL active high
+		| ((uint16_t)(p->decimation & 0b11) << 8)
+		| ((uint16_t)((p->stages - 1) & 0b1111) << 4)
+		| ((p->lpDelay & 0b11) << 2)
+		| (p->powerMode & 0b11);
 }
 
-void writeStage1_Connection127(){
+// conversion time of one stage in us
+uint16_t stageConversionUs(uint8_t decimation){
 	
-	writeByte(STAGE1_CONNECTION127,0b0001111111111111);
+	return 768 >> decimation;		// 256 -> 768, 128 -> 384, 64 -> 192
 }
 
-void writeStage2_Connection60(){
+// time from one set of results to the next in us
+uint32_t sequenceUs(const PwrSettings *p){
 	
-	writeByte(STAGE2_CONNECTION60,0b0011111111101111);		//CIN2 Connected to CDC Positive input, CIN0 and CIN2 not connected to CDC inputs, all other CINx are connected to BIAS
+	uint32_t us = (uint32_t)p->stages * stageConversionUs(p->decimation);
+	if (p->powerMode == LOW_POWER)
+		us += (p->lpDelay + 1) * 200000UL;
+	return us;
 }
 
-void writeStage2_Connection127(){
-	
-	writeByte(STAGE2_CONNECTION127,0b0001111111111111);
+void writePwr_Control(){
+  	  writeByte(PWR_CONTROL,pwrControlValue(&pwr));		
+
 }
 
-void writeStage3_Connection60(){
-	
-	writeByte(STAGE3_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+void printPwr_Control(){
+	Serial.print(F("C\t"));
+	Serial.print(pwrControlValue(&pwr));
+	Serial.write('\t');
+	Serial.println(sequenceUs(&pwr));
 }
 
-void writeStage3_Connection127(){
-	
-	writeByte(STAGE3_CONNECTION127,0b1100111111111111);		
+// C<decimation>,<stages>,<power mode>,<delay> from the host, missing fields stay as they are
+void setPwr_Control(const char *args){
+	if (*args == 0)
+		return;
+	char *end;
+	uint8_t values[4] = { pwr.decimation, pwr.stages, pwr.powerMode, pwr.lpDelay };
+	for (uint8_t i = 0; i < 4 && *args; i++) {
+		values[i] = strtol(args, &end, 10);
+		args = *end == ',' ? end + 1 : end;
+	}
+	if (values[0] > DECIMATE_64 || values[1] < 1 || values[1] > 12 || values[2] > LOW_POWER || values[3] > LP_DELAY_800MS)
+		return;			// ignore settings the chip does not have, the reply shows what is in use
+	pwr.decimation = values[0];
+	pwr.stages = values[1];
+	pwr.powerMode = values[2];
+	pwr.lpDelay = values[3];
+	writePwr_Control();
 }
 
-void writeStage4_Connection60(){
+void writeStage_Cal_En(){
 	
-	writeByte(STAGE4_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	writeByte(STAGE_CAL_EN,0b0000000000000111);
 }
 
-void writeStage4_Connection127(){
+
+
+
+
+/*
+Event reporting
+The AD7147 compares every stage with a high and a low threshold on its own. The thresholds
+follow the calibrated ambient value (STAGE_CAL_EN) and are set per stage by:
+ - STAGEx_OFFSET_HIGH / STAGEx_OFFSET_LOW: how far the result is expected to move when the
+   sensor is loaded, used as the starting full scale
+ - STAGEx_OFFSET_HIGH_CLAMP / STAGEx_OFFSET_LOW_CLAMP: the largest full scale the chip may
+   adapt to. They power up undefined, so they are always written
+ - STAGEx_SENSITIVITY: the threshold as a percentage of that full scale
+   bits 3:0 negative threshold sensitivity, 0000 = 25%
+   bits 6:4 negative peak detect, 010 = 50%
+   bits 11:8 positive threshold sensitivity, 0000 = 25%
+   bits 14:12 positive peak detect, 010 = 50%
+While a stage is above its high threshold (or below its low threshold) its bit is set in
+STAGE_HIGH_INT_STATUS (STAGE_LOW_INT_STATUS). The thresholds the chip works out are in
+STAGEx_HIGH_THRESHOLD / STAGEx_LOW_THRESHOLD and are part of the register dump at start.
+
+With event reporting on (EVENT_REPORTING, or R1 from the host) the loop only reads the two
+status registers each period. Samples are read and sent at the full rate while any stage is
+active and for EVENT_HOLD_MS after, otherwise one heartbeat sample every HEARTBEAT_MS so the
+host still sees the baseline and keeps its clock fit. R0 goes back to sending everything.
+*/
+#define EVENT_REPORTING 0
+#define EVENT_STAGES 0b0000000000000111		// stages 0, 1 and 2 can wake the stream
+#define STAGE_OFFSET_VALUE 2000						// expected change of the result under load, in codes
+#define STAGE_OFFSET_CLAMP_VALUE 2500			// the adaptive full scale stays below this, in codes
+#define STAGE_SENSITIVITY_VALUE 0b0010000000100000
+#define EVENT_HOLD_MS 500									// keep streaming this long after the last active sample
+#define HEARTBEAT_MS 1000									// idle sample rate
+
+uint8_t eventReporting = EVENT_REPORTING;
+uint32_t activeUntilMs;
+uint32_t lastReportMs;
+
+void writeStage0_Sensitivity(){
 	
-	writeByte(STAGE4_CONNECTION127,0b1100111111111111);
+	writeByte(STAGE0_SENSITIVITY,STAGE_SENSITIVITY_VALUE);
+	writeByte(STAGE0_OFFSET_LOW,STAGE_OFFSET_VALUE);
+	writeByte(STAGE0_OFFSET_HIGH,STAGE_OFFSET_VALUE);
+	writeByte(STAGE0_OFFSET_HIGH_CLAMP,STAGE_OFFSET_CLAMP_VALUE);
+	writeByte(STAGE0_OFFSET_LOW_CLAMP,STAGE_OFFSET_CLAMP_VALUE);
 }
 
-void writeStage5_Connection60(){
+void writeStage1_Sensitivity(){
 	
-	writeByte(STAGE5_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	writeByte(STAGE1_SENSITIVITY,STAGE_SENSITIVITY_VALUE);
+	writeByte(STAGE1_OFFSET_LOW,STAGE_OFFSET_VALUE);
+	writeByte(STAGE1_OFFSET_HIGH,STAGE_OFFSET_VALUE);
+	writeByte(STAGE1_OFFSET_HIGH_CLAMP,STAGE_OFFSET_CLAMP_VALUE);
+	writeByte(STAGE1_OFFSET_LOW_CLAMP,STAGE_OFFSET_CLAMP_VALUE);
 }
 
-void writeStage5_Connection127(){
+void writeStage2_Sensitivity(){
 	
-	writeByte(STAGE5_CONNECTION127,0b1100111111111111);
+	writeByte(STAGE2_SENSITIVITY,STAGE_SENSITIVITY_VALUE);
+	writeByte(STAGE2_OFFSET_LOW,STAGE_OFFSET_VALUE);
+	writeByte(STAGE2_OFFSET_HIGH,STAGE_OFFSET_VALUE);
+	writeByte(STAGE2_OFFSET_HIGH_CLAMP,STAGE_OFFSET_CLAMP_VALUE);
+	writeByte(STAGE2_OFFSET_LOW_CLAMP,STAGE_OFFSET_CLAMP_VALUE);
 }
 
-void writeStage6_Connection60(){
+void writeStage_Low_Int_Enable(){
 	
-	writeByte(STAGE6_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	writeByte(STAGE_LOW_INT_ENABLE,EVENT_STAGES);		//low limit of stages 0-2, GPIO not used
 }
 
-void writeStage6_Connection127(){
+void writeStage_Hight_Int_Enable(){
+	
+	writeByte(STAGE_HIGH_INT_ENABLE,EVENT_STAGES);
 	
-	writeByte(STAGE6_CONNECTION127,0b1100111111111111);
 }
 
-void writeStage7_Connection60(){
+// true while any of the event stages is past one of its thresholds
+bool sensorActive(){
 	
-	writeByte(STAGE7_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	uint16_t status = readByte(STAGE_HIGH_INT_STATUS) | readByte(STAGE_LOW_INT_STATUS);
+	return (status & EVENT_STAGES) != 0;
 }
 
-void writeStage7_Connection127(){
+// decides if this period sends a sample
+bool reportDue(uint32_t nowMs){
 	
-	writeByte(STAGE7_CONNECTION127,0b1100111111111111);
+	if (!eventReporting)
+		return true;
+	if (sensorActive())
+		activeUntilMs = nowMs + EVENT_HOLD_MS;
+	if ((int32_t)(activeUntilMs - nowMs) > 0)
+		return true;
+	return nowMs - lastReportMs >= HEARTBEAT_MS;
 }
 
-void writeStage8_Connection60(){
+void writeStage_Complete_Int_Enable(){
 	
-	writeByte(STAGE8_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	writeByte(STAGE_COMPLETE_INT_ENABLE,0b100);
 }
 
-void writeStage8_Connection127(){
+void readStage_Complete_Int_Status(){
 	
-	writeByte(STAGE8_CONNECTION127,0b1100111111111111);
+	readByte(STAGE_COMPLETE_INT_STATUS);
 }
 
-void writeStage9_Connection60(){
+
+
+/*
+Latency probe
+With LATENCY_PROBE set (or L1 from the host) every sample is timed on the board:
+ - conversion: the status is read once to clear it, then polled until the stage set in
+   STAGE_COMPLETE_INT_ENABLE finishes. Each poll is a readByte, so the time is late by up
+   to one poll (about 1.2 ms with the 1 ms delay in readByte)
+ - read: the three CDC results are in
+ - queued: the line is in the Serial transmit buffer
+ - sent: Serial.flush() returned, the last byte left the UART
+The sample line carries the conversion time as its board time, and right after it comes
+L<tab>conversion us<tab>read us<tab>queued us<tab>sent us
+bin/raw/latency.rb puts these on the host clock (with the P/Y pings) and adds the host
+side. The flush makes the loop wait for the UART, so only use this for measuring.
+*/
+#define LATENCY_PROBE 0
+#define COMPLETE_STAGE_BIT 0b100				// stage 2, the last stage read, see writeStage_Complete_Int_Enable
+#define COMPLETE_TIMEOUT_US 50000UL		// give up waiting (shutdown mode, chip missing)
+
+uint8_t latencyProbe = LATENCY_PROBE;
+
+// returns the board time the next conversion sequence was seen to finish
+uint32_t waitConversionComplete(){
 	
-	writeByte(STAGE9_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	readByte(STAGE_COMPLETE_INT_STATUS);		// reading clears it, so the next set bit is a new sequence
+	uint32_t startUs = micros();
+	while (!(readByte(STAGE_COMPLETE_INT_STATUS) & COMPLETE_STAGE_BIT)) {
+		if (micros() - startUs > COMPLETE_TIMEOUT_US)
+			break;
+	}
+	return micros();
 }
 
-void writeStage9_Connection127(){
-	
-	writeByte(STAGE9_CONNECTION127,0b1100111111111111);
+void printLatency(uint32_t conversionUs, uint32_t readUs, uint32_t queuedUs, uint32_t sentUs){
+	Serial.print(F("L\t"));
+	Serial.print(conversionUs);
+	Serial.write('\t');
+	Serial.print(readUs);
+	Serial.write('\t');
+	Serial.print(queuedUs);
+	Serial.write('\t');
+	Serial.println(sentUs);
 }
 
-void writeStage10_Connection60(){
-	
-	writeByte(STAGE10_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+
+
+/*
+Gait event detection
+The three stages together give the load on the insole. We add the three CDC results
+into one number and run a small state machine on it every sample:
+ - SWING: foot is in the air. The baseline (the unloaded value) is slowly tracked here
+   with an exponential average so drift from temperature and sock moisture is removed.
+ - STANCE: foot is on the ground. We remember the peak load of this step.
+
+heel-strike = in SWING, load above baseline by GAIT_ON_THRESHOLD and still rising
+toe-off     = in STANCE, load drops below a fraction of this step's peak (never below
+              GAIT_OFF_MIN) and still falling
+The on and off levels are different (hysteresis) so noise around one level cannot toggle
+the state, and GAIT_MIN_STATE_MS blocks a second event right after the first one.
+
+The event time is interpolated between the previous and the current sample, so it is
+not rounded up to the next sample. Every call does the same small amount of work and
+the detector is only a few bytes, so it can run after every read.
+The host has the same detector in bin/raw/gait.rb.
+*/
+#define GAIT_DETECT 0						// 1 = print E lines for heel-strike/toe-off on the board
+#define GAIT_POLARITY 1					// 1 if the CDC result goes up with load, -1 if it goes down
+#define GAIT_ON_THRESHOLD 400		// codes above baseline for heel-strike
+#define GAIT_OFF_MIN 150				// lowest toe-off level in codes above baseline
+#define GAIT_OFF_SHIFT 2				// toe-off level = step peak >> GAIT_OFF_SHIFT (peak/4)
+#define GAIT_BASELINE_SHIFT 5		// baseline average weight = 1/32 per sample
+#define GAIT_MIN_STATE_MS 80		// refractory time between two events
+
+#define GAIT_NONE 0
+#define GAIT_HEEL_STRIKE 1
+#define GAIT_TOE_OFF 2
+
+struct GaitDetector {
+	int32_t baseline;		// baseline << GAIT_BASELINE_SHIFT, keeps the fraction bits of the average
+	int32_t prevLoad;		// load - baseline of the previous sample
+	int32_t peak;				// highest load of this stance
+	uint32_t prevMs;		// time of the previous sample
+	uint32_t edgeMs;		// time of the last event
+	uint8_t stance;
+	uint8_t started;
+};
+
+GaitDetector gait;
+
+// linear interpolation of the time where the load crossed level between the last two samples
+uint32_t gaitCrossing(int32_t prev, int32_t now, int32_t level, uint32_t prevMs, uint32_t nowMs) {
+	if (now == prev)
+		return nowMs;
+	return prevMs + (int32_t)(nowMs - prevMs) * (level - prev) / (now - prev);
+}
+
+// feed one sample, returns GAIT_HEEL_STRIKE, GAIT_TOE_OFF or GAIT_NONE. *eventMs is the event time
+uint8_t gaitFeed(GaitDetector *g, int32_t rawLoad, uint32_t nowMs, uint32_t *eventMs) {
+	int32_t signedLoad = GAIT_POLARITY * rawLoad;
+	if (!g->started) {			// first sample is the starting baseline
+		g->baseline = signedLoad << GAIT_BASELINE_SHIFT;
+		g->prevLoad = 0;
+		g->prevMs = nowMs;
+		g->edgeMs = nowMs;
+		g->started = 1;
+		return GAIT_NONE;
+	}
+
+	int32_t load = signedLoad - (g->baseline >> GAIT_BASELINE_SHIFT);
+	int32_t slope = load - g->prevLoad;
+	uint8_t event = GAIT_NONE;
+	bool settled = (nowMs - g->edgeMs) >= GAIT_MIN_STATE_MS;
+
+	if (!g->stance) {
+		if (settled && load > GAIT_ON_THRESHOLD && slope > 0) {
+			*eventMs = gaitCrossing(g->prevLoad, load, GAIT_ON_THRESHOLD, g->prevMs, nowMs);
+			g->stance = 1;
+			g->peak = load;
+			event = GAIT_HEEL_STRIKE;
+		}
+		else {
+			g->baseline += signedLoad - (g->baseline >> GAIT_BASELINE_SHIFT);	// only learn the baseline in the air
+		}
+	}
+	else {
+		if (load > g->peak)
+			g->peak = load;
+		int32_t offLevel = g->peak >> GAIT_OFF_SHIFT;
+		if (offLevel < GAIT_OFF_MIN)
+			offLevel = GAIT_OFF_MIN;
+		if (settled && load < offLevel && slope < 0) {
+			*eventMs = gaitCrossing(g->prevLoad, load, offLevel, g->prevMs, nowMs);
+			g->stance = 0;
+			event = GAIT_TOE_OFF;
+		}
+	}
+
+	if (event != GAIT_NONE)
+		g->edgeMs = nowMs;
+	g->prevLoad = load;
+	g->prevMs = nowMs;
+	return event;
 }
 
-void writeStage10_Connection127(){
+// E<tab>HS<tab>time or E<tab>TO<tab>time, time in ms from the board's millis()
+void printGaitEvent(uint8_t event, uint32_t eventMs) {
+	Serial.print(F("E\t"));
+	Serial.print(event == GAIT_HEEL_STRIKE ? F("HS\t") : F("TO\t"));
+	Serial.println(eventMs);
+}
+
+
+
+/*
+Task scheduler
+The work of the loop is split into tasks. A task does a little and returns, nothing is
+interrupted in the middle (cooperative), so the tasks share the globals without locks:
+ - periodic tasks are released every periodMs, event tasks when another task or the
+   scheduler calls taskSignal()
+ - of the released tasks the one highest in the table runs first. Acquire releases filter
+   and transmit, so a task below them only runs when they are idle; command sits right
+   under acquire so it always gets a turn after a sample, even when the link is full
+ - every release has a deadline, deadlineMs after the release (0 = the task's period, for
+   an event task the sample period). A task that finishes after its deadline, or is
+   released again before it ran, counts a miss. A periodic task a whole period behind
+   skips the releases it lost (one miss) instead of running them back to back
+ - with nothing released the CPU sleeps in idle mode; the timer 0 interrupt behind
+   millis() (every 2.048 ms at 8 MHz, every 1 ms in the lean build) and the UART receive
+   interrupt wake it
+
+Tasks, highest priority first:
+ acquire       reads the three CDC results into the sample queue, every sample period
+ command       host commands and sync pulses, released when something is waiting
+ filter        gait detection on the new samples (GAIT_DETECT)
+ transmit      prints the new samples
+ housekeeping  closes the CPU utilization window every HOUSEKEEPING_MS
+The sample period cannot be set (F<ms>) below one acquire plus one sample line at
+SERIAL_BAUD, about 34 ms at 9600: shorter, and acquire and transmit would be released
+back to back for ever with housekeeping never running. F replies F<tab>period in ms used.
+Acquire only puts the sample in a small queue, so printing at 9600 baud or a burst of host
+commands does not move the next read. If the queue is full the sample is dropped and
+counted. The run time of every task is summed with micros(); U from the host prints
+U<tab>task<tab>CPU use in 1/1000 over the last window<tab>longest run in us<tab>runs in
+the last window<tab>deadline misses since reset
+for each task, then U<tab>idle<tab>CPU left in 1/1000<tab>samples dropped and
+U<tab>stack<tab>bytes of free RAM the stack has never reached since reset.
+*/
+#define SAMPLE_PERIOD_MS 100		// time between two samples, F<ms> from the host changes it
+#define SERIAL_BAUD 9600
+#define SAMPLE_LINE_MAX 29			// 3 results of 5 digits, 10 digits of board time, 3 tabs, \n
+#define COMMAND_DEADLINE_MS 2		// pings are time stamped when they are read, so read them soon
+#define HOUSEKEEPING_MS 1000		// utilization window
+#define SCHEDULER_SLEEP 1				// 0 = spin instead of sleeping when idle
+#if LEAN_BUILD
+#define SAMPLE_QUEUE_LENGTH 16	// samples between acquire and the other tasks, power of two
+#else
+#define SAMPLE_QUEUE_LENGTH 4
+#endif
+#define STACK_PAINT 0xC5				// free RAM is filled with this at reset, see unusedStack()
+
+#define TASK_ACQUIRE 0
+#define TASK_COMMAND 1
+#define TASK_FILTER 2
+#define TASK_TRANSMIT 3
+#define TASK_HOUSEKEEPING 4
+#define TASK_COUNT 5
+
+struct Task {
+	void (*run)();
+	const char *name;				// in flash
+	uint16_t periodMs;			// 0 = event task
+	uint16_t deadlineMs;		// after the release, 0 = one period
+	uint32_t releaseMs;			// release the task is ready for
+	uint32_t nextMs;				// next release of a periodic task
+	uint8_t ready;
+	uint16_t misses;				// since reset
+	uint16_t worstUs;				// longest run since reset
+	uint16_t runs;					// in this window
+	uint32_t busyUs;				// run time in this window
+	uint16_t lastRuns;			// runs in the last window
+	uint16_t utilization;		// 1/1000 of the CPU in the last window
+};
+
+void acquireTask();
+void commandTask();
+void filterTask();
+void transmitTask();
+void housekeepingTask();
+
+const char acquireName[] PROGMEM = "acquire";
+const char commandName[] PROGMEM = "command";
+const char filterName[] PROGMEM = "filter";
+const char transmitName[] PROGMEM = "transmit";
+const char housekeepingName[] PROGMEM = "housekeeping";
+
+// in priority order
+Task tasks[TASK_COUNT] = {
+	{ acquireTask, acquireName, SAMPLE_PERIOD_MS, 0 },
+	{ commandTask, commandName, 0, COMMAND_DEADLINE_MS },
+	{ filterTask, filterName, 0, 0 },
+	{ transmitTask, transmitName, 0, 0 },
+	{ housekeepingTask, housekeepingName, HOUSEKEEPING_MS, 0 },
+};
+uint32_t windowStartUs;
+
+struct QueuedSample {
+	uint16_t cdc[3];
+	uint32_t sampleUs;		// board time of the sample (end of conversion with the latency probe)
+	uint32_t sampleMs;
+	uint32_t readUs;			// results read, for the latency probe
+};
+
+QueuedSample sampleQueue[SAMPLE_QUEUE_LENGTH];
+uint8_t sampleHead;				// samples put in the queue, wraps at 256 like the tails
+uint8_t filterTail;				// samples the filter task is done with
+uint8_t transmitTail;			// samples sent
+uint16_t sampleOverruns;	// samples dropped because the queue was full
+
+uint16_t taskDeadlineMs(const Task *t){
 	
-	writeByte(STAGE10_CONNECTION127,0b1100111111111111);
+	if (t->deadlineMs)
+		return t->deadlineMs;
+	return t->periodMs ? t->periodMs : tasks[TASK_ACQUIRE].periodMs;
 }
 
-void writeStage11_Connection60(){
+// releaseMs is when the task should have been released, lateness counts from there
+void taskRelease(uint8_t i, uint32_t releaseMs){
 	
-	writeByte(STAGE11_CONNECTION60,0b0011111111111111);		//CIN0,1,2 not connected to CDC inputs, all other CINx are connected to BIAS
+	Task *t = &tasks[i];
+	if (t->ready) {			// the last release has not run yet
+		t->misses++;
+		return;
+	}
+	t->ready = 1;
+	t->releaseMs = releaseMs;
 }
 
-void writeStage11_Connection127(){
+void taskSignal(uint8_t i){
 	
-	writeByte(STAGE11_CONNECTION127,0b1100111111111111);
+	taskRelease(i, millis());
 }
 
-void writeStage0_Afe_Offset(){
+void releasePeriodic(uint32_t nowMs){
 	
-	writeByte(STAGE0_AFE_OFFSET,0b1000010010010111);
+	for (uint8_t i = 0; i < TASK_COUNT; i++) {
+		Task *t = &tasks[i];
+		if (t->periodMs == 0 || (int32_t)(nowMs - t->nextMs) < 0)
+			continue;
+		taskRelease(i, t->nextMs);
+		t->nextMs += t->periodMs;
+		if ((int32_t)(nowMs - t->nextMs) >= 0) {
+			t->misses++;
+			t->nextMs = nowMs + t->periodMs;
+		}
+	}
+}
+
+// shortest sample period the link keeps up with: the longest acquire so far and one line
+uint16_t samplePeriodMinMs(){
 	
+	uint32_t us = tasks[TASK_ACQUIRE].worstUs + SAMPLE_LINE_MAX * 10000000UL / SERIAL_BAUD;
+	return us / 1000 + 1;
 }
 
-void writeStage1_Afe_Offset(){
+// runs the highest released task, false if none is released
+bool runNextTask(){
 	
-	writeByte(STAGE1_AFE_OFFSET,0b1000001010010001);
+	for (uint8_t i = 0; i < TASK_COUNT; i++) {
+		Task *t = &tasks[i];
+		if (!t->ready)
+			continue;
+		t->ready = 0;		// before run(), so the task can release itself again
+		uint32_t startUs = micros();
+		t->run();
+		uint32_t busyUs = micros() - startUs;
+		if ((int32_t)(millis() - t->releaseMs) > (int32_t)taskDeadlineMs(t))
+			t->misses++;
+		t->busyUs += busyUs;
+		t->runs++;
+		if (busyUs > t->worstUs)
+			t->worstUs = busyUs > 0xFFFF ? 0xFFFF : busyUs;
+		return true;
+	}
+	return false;
+}
+
+extern uint8_t __heap_start;		// end of .data and .bss from the linker, nothing here uses the heap
+
+// runs in the startup code before main(), the stack is still empty
+void paintStack() __attribute__((naked, used, section(".init3")));
+void paintStack(){
 	
+	for (uint8_t *p = &__heap_start; p < (uint8_t *)SP; p++)
+		*p = STACK_PAINT;
 }
 
-void writeStage2_Afe_Offset(){
+uint16_t unusedStack(){
 	
-	writeByte(STAGE2_AFE_OFFSET,0b1000001110010100);
+	uint8_t *p = &__heap_start;
+	while (p < (uint8_t *)SP && *p == STACK_PAINT)
+		p++;
+	return p - &__heap_start;
+}
+
+void printUtilization(){
 	
+	uint16_t used = 0;
+	for (uint8_t i = 0; i < TASK_COUNT; i++) {
+		Task *t = &tasks[i];
+		used += t->utilization;
+		Serial.print(F("U\t"));
+		Serial.print((const __FlashStringHelper *)t->name);
+		Serial.write('\t');
+		Serial.print(t->utilization);
+		Serial.write('\t');
+		Serial.print(t->worstUs);
+		Serial.write('\t');
+		Serial.print(t->lastRuns);
+		Serial.write('\t');
+		Serial.println(t->misses);
+	}
+	Serial.print(F("U\tidle\t"));
+	Serial.print(used < 1000 ? 1000 - used : 0);
+	Serial.write('\t');
+	Serial.println(sampleOverruns);
+	Serial.print(F("U\tstack\t"));
+	Serial.println(unusedStack());
 }
 
-void writePwr_Control(){
-  	  writeByte(PWR_CONTROL,0b0000101000100000);		
 
+
+/*
+Clock synchronization
+Each board has its own crystal, so the left and right insole clocks drift apart and the
+host cannot line up their samples from arrival time (the USB-serial adapter holds bytes
+for several ms). So every sample carries the board time in us (micros()) as a 4th column,
+and the host asks the board what time it is:
+
+host  -> board   P<seq>\n
+board -> host    Y<tab>seq<tab>board time in us when the \n was received
+
+The host knows when it sent and received each exchange, and bin/raw/sync.rb fits the
+board clock against the host clock from many of these (see the comments there).
+If SYNC_INT is set, a pulse on that external interrupt pin (wired to both boards) is
+time stamped in the interrupt and reported as S<tab>count<tab>board time in us.
+*/
+#define SYNC_INT -1							// external interrupt number of the shared sync line (0 = INT0), -1 = not used
+#define COMMAND_LENGTH 16				// longest command line from the host
+
+char commandLine[COMMAND_LENGTH];
+uint8_t commandLength;
+
+volatile uint32_t syncPulseUs;
+volatile uint16_t syncPulseCount;
+uint16_t syncPulseReported;
+
+void syncPulse() {
+	syncPulseUs = micros();
+	syncPulseCount++;
 }
 
-void writeStage_Cal_En(){
-	
-	writeByte(STAGE_CAL_EN,0b0000000000000111);
+// handles one full line from the host, rxUs is the time its last byte was read
+void runCommand(const char *line, uint32_t rxUs) {
+	switch (line[0]) {
+		case 'P':		// ping, echo the sequence number with our time
+			Serial.print(F("Y\t"));
+			Serial.print(atol(line + 1));
+			Serial.write('\t');
+			Serial.println(rxUs);
+			break;
+		case 'C':		// PWR_CONTROL settings
+			setPwr_Control(line + 1);
+			printPwr_Control();
+			break;
+		case 'F':		// sample period in ms, not below samplePeriodMinMs()
+			if (atoi(line + 1) > 0) {
+				uint16_t periodMs = atoi(line + 1);
+				uint16_t minMs = samplePeriodMinMs();
+				tasks[TASK_ACQUIRE].periodMs = periodMs < minMs ? minMs : periodMs;
+			}
+			Serial.print(F("F\t"));
+			Serial.println(tasks[TASK_ACQUIRE].periodMs);
+			break;
+		case 'U':		// CPU use per task, see the scheduler
+			printUtilization();
+			break;
+		case 'L':		// L1 = time every sample, L0 = off
+			latencyProbe = line[1] == '1';
+			break;
+		case 'R':		// R1 = event reporting, R0 = send every sample
+			eventReporting = line[1] == '1';
+			break;
+#if I2C_TRACE
+		case 'T':		// dump the I2C trace
+			traceDump();
+			break;
+#endif
+	}
 }
 
+// reads whatever the host sent without waiting, runs complete lines
+void pollCommands() {
+	while (Serial.available() > 0) {
+		char c = Serial.read();
+		if (c == '\n' || c == '\r') {
+			uint32_t rxUs = micros();
+			commandLine[commandLength] = 0;
+			if (commandLength > 0)
+				runCommand(commandLine, rxUs);
+			commandLength = 0;
+		}
+		else if (commandLength < COMMAND_LENGTH - 1) {
+			commandLine[commandLength++] = c;
+		}
+	}
+}
 
+void pollSyncPulse() {
+	if (syncPulseCount == syncPulseReported)
+		return;
+	uint8_t oldSREG = SREG;		// copy the 32 bit time without the interrupt changing it halfway
+	cli();
+	uint32_t pulseUs = syncPulseUs;
+	uint16_t count = syncPulseCount;
+	SREG = oldSREG;
+	syncPulseReported = count;
+	Serial.print(F("S\t"));
+	Serial.print(count);
+	Serial.write('\t');
+	Serial.println(pulseUs);
+}
 
+// one sample into the queue; with event reporting most periods only read the status registers
+void acquireTask(){
+	
+	traceRecord(TRACE_MARK, 0, 0, 0);
+	uint32_t sampleUs = micros();
+	uint32_t sampleMs = millis();
+	if (!reportDue(sampleMs))		// nothing is touching the sensors
+		return;
+	lastReportMs = sampleMs;
+	if ((uint8_t)(sampleHead - filterTail) >= SAMPLE_QUEUE_LENGTH || (uint8_t)(sampleHead - transmitTail) >= SAMPLE_QUEUE_LENGTH) {
+		sampleOverruns++;
+		return;
+	}
+	if (latencyProbe)
+		sampleUs = waitConversionComplete();
+	QueuedSample *s = &sampleQueue[sampleHead & (SAMPLE_QUEUE_LENGTH - 1)];
+	s->cdc[0] = readByte(CDC_RESULT_S0);
+	s->cdc[1] = readByte(CDC_RESULT_S1);
+	s->cdc[2] = readByte(CDC_RESULT_S2);
+	s->readUs = micros();
+	s->sampleUs = sampleUs;
+	s->sampleMs = sampleMs;
+	sampleHead++;
+	taskSignal(TASK_FILTER);
+	taskSignal(TASK_TRANSMIT);
+}
 
+void filterTask(){
+	
+	while (filterTail != sampleHead) {
+#if GAIT_DETECT
+		QueuedSample *s = &sampleQueue[filterTail & (SAMPLE_QUEUE_LENGTH - 1)];
+		uint32_t eventMs;
+		uint8_t event = gaitFeed(&gait, (int32_t)s->cdc[0] + s->cdc[1] + s->cdc[2], s->sampleMs, &eventMs);
+		if (event != GAIT_NONE)
+			printGaitEvent(event, eventMs);
+#endif
+		filterTail++;
+	}
+}
 
-void writeStage_Low_Int_Enable(){
+void transmitTask(){
 	
-	writeByte(STAGE_LOW_INT_ENABLE,0b0000000000000000);
+	while (transmitTail != sampleHead) {
+		QueuedSample *s = &sampleQueue[transmitTail & (SAMPLE_QUEUE_LENGTH - 1)];
+		Serial.print(s->cdc[0]);
+		Serial.write('\t');
+		Serial.print(s->cdc[1]);
+		Serial.write('\t');
+		Serial.print(s->cdc[2]);
+		Serial.write('\t');
+		Serial.print(s->sampleUs);	// board time, lets the host line up several boards
+		Serial.write('\n');
+		if (latencyProbe) {
+			uint32_t queuedUs = micros();
+			Serial.flush();
+			printLatency(s->sampleUs, s->readUs, queuedUs, micros());
+		}
+		transmitTail++;
+	}
 }
 
-void writeStage_Hight_Int_Enable(){
+void commandTask(){
 	
-	writeByte(STAGE_HIGH_INT_ENABLE,0b0000000000000000);
+	pollCommands();
+	pollSyncPulse();
+}
+
+// closes the utilization window
+void housekeepingTask(){
 	
+	uint32_t nowUs = micros();
+	uint32_t windowMs = (nowUs - windowStartUs) / 1000;
+	windowStartUs = nowUs;
+	for (uint8_t i = 0; i < TASK_COUNT; i++) {
+		Task *t = &tasks[i];
+		t->utilization = windowMs ? t->busyUs / windowMs : 0;		// us per ms = 1/1000
+		t->lastRuns = t->runs;
+		t->busyUs = 0;
+		t->runs = 0;
+	}
 }
 
-void writeStage_Complete_Int_Enable(){
+bool commandPending(){
 	
-	writeByte(STAGE_COMPLETE_INT_ENABLE,0b100);
+	return Serial.available() > 0 || syncPulseCount != syncPulseReported;
 }
 
-void readStage_Complete_Int_Status(){
+// sleeps until the next interrupt, unless one came in since the last check
+void idleSleep(){
 	
-	readByte(STAGE_COMPLETE_INT_STATUS);
+#if SCHEDULER_SLEEP
+	set_sleep_mode(SLEEP_MODE_IDLE);	// the timers and the UART keep running
+	cli();
+	if (!commandPending()) {
+		sleep_enable();
+		sei();				// the instruction after sei always runs, so a wake up cannot be lost in between
+		sleep_cpu();
+		sleep_disable();
+	}
+	sei();
+#endif
+}
+
+// never returns
+void runScheduler(){
+	
+	uint32_t nowMs = millis();
+	for (uint8_t i = 0; i < TASK_COUNT; i++)
+		tasks[i].nextMs = nowMs;
+	windowStartUs = micros();
+	while (1) {
+		releasePeriodic(millis());
+		if (!tasks[TASK_COMMAND].ready && commandPending())
+			taskSignal(TASK_COMMAND);
+		if (!runNextTask())
+			idleSleep();
+	}
 }
 
 int main(){ // this function runs immeadiately upon upload
   //run once
   init(); // calls some arduino intializing to allow the arduino library to be used
-  Serial.begin(9600);	// Start USART0 (TX0 and RX0)
+  Serial.begin(SERIAL_BAUD);	// Start USART0 (TX0 and RX0)
   Wire.begin();	  // Start the Wire library
+#if SYNC_INT >= 0
+  attachInterrupt(SYNC_INT, syncPulse, RISING);	// time stamp the shared sync line
+#endif
   
-  writeStage0_Connection60();
-  writeStage0_Connection127();
-  writeStage0_Afe_Offset();
-  writeStage1_Connection60();
-  writeStage1_Connection127();
-  writeStage1_Afe_Offset();
-  writeStage2_Connection60();
-  writeStage2_Connection127();
-  writeStage2_Afe_Offset();
-  writeStage3_Connection60();
-  writeStage3_Connection127();
-  writeStage4_Connection60();
-  writeStage4_Connection127();
-  writeStage5_Connection60();
-  writeStage5_Connection127();
-  writeStage6_Connection60();
-  writeStage6_Connection127();
-  writeStage7_Connection60();
-  writeStage7_Connection127();
-  writeStage8_Connection60();
-  writeStage8_Connection127();
-  writeStage9_Connection60();
-  writeStage9_Connection127();
-  writeStage10_Connection60();
-  writeStage10_Connection127();
-  writeStage11_Connection60();
-  writeStage11_Connection127();
+  writeStageSetup();
+  writeStage0_Sensitivity();
+  writeStage1_Sensitivity();
+  writeStage2_Sensitivity();
  
   writePwr_Control();
   
@@ -411,61 +1242,9 @@ int main(){ // this function runs immeadiately upon upload
   
   readStage_Complete_Int_Status();
   
-  // print what is in the power control register this will be in decimal form, so convert it later
-  Serial.print("PWR_CONTROL""\t");
-  Serial.println(readByte(PWR_CONTROL)); 
-  
-  
-  
-  Serial.print("\nSTAGE_CAL_EN""\t");
-  Serial.println(readByte(STAGE_CAL_EN));
+  printRegisters();
   
-  
-  
-  Serial.print("\nStage0_Connection[6:0]""\t");
-  Serial.println(readByte(STAGE0_CONNECTION60));
-  
-  Serial.print("\nStage0_Connection[12:7]""\t");
-  Serial.println(readByte(STAGE0_CONNECTION127));
-  
-  Serial.print("\nStage1_Connection[6:0]""\t");
-  Serial.println(readByte(STAGE1_CONNECTION60));
-  
-  Serial.print("\nStage1_Connection[12:7]""\t");
-  Serial.println(readByte(STAGE1_CONNECTION127));
-  
-  Serial.print("\nStage2_Connection[6:0]""\t");
-  Serial.println(readByte(STAGE2_CONNECTION60));
-  
-  Serial.print("\nStage2_Connection[12:7]""\t");
-  Serial.println(readByte(STAGE2_CONNECTION127));
-  
-
-  
-  Serial.println(readByte(STAGE0_AFE_OFFSET));
-  Serial.println(readByte(STAGE1_AFE_OFFSET));
-  Serial.println(readByte(STAGE2_AFE_OFFSET));
-  
-  
-while (1) {  
-	  
-	  
-	
-	 
-	 
-	 
-	 Serial.print(readByte(CDC_RESULT_S0));
-	 Serial.print("\t");
-	 Serial.print(readByte(CDC_RESULT_S1));
-	 Serial.print("\t");
-	 Serial.print(readByte(CDC_RESULT_S2));
-	 Serial.print("\n");
-	
-	 _delay_ms(100);
-	 
-	 
-	 
-}
+  runScheduler();
   return(0);
 }
 